@@ -0,0 +1,39 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+///////////////////////////////////////////////////////////////////////////////
+// Static tracepoints
+// With <sys/sdt.h> (systemtap-sdt-dev) every PROBE is a single nop plus a
+// note in the binary; perf and bpftrace patch a breakpoint in only while they
+// are attached. Without the header, or built with -DTWMAILER_NO_PROBES, they
+// compile to nothing; their arguments are only looked at by sizeof, never
+// evaluated.
+//   bpftrace -l 'usdt:./bin/twmailer-server:*'
+//   bpftrace -e 'usdt:./bin/twmailer-server:twmailer:auth_start { @start[tid] = nsecs; }
+//                usdt:./bin/twmailer-server:twmailer:auth_end { @ldap = hist(nsecs - @start[tid]); }'
+//   perf buildid-cache --add ./bin/twmailer-server && perf record -e 'sdt_twmailer:*' -p <pid>
+// Probes of provider twmailer and their arguments:
+//   command_receive  socket, bytes
+//   command_parse    command, field count
+//   command_done     command, reply bytes
+//   auth_start       user
+//   auth_end         user, result (0 = success)
+//   spool_open       path, 0 or -1 (messages, written aside before numbering)
+//   spool_write      path, bytes
+//   spool_close      path, 0 or -1 (the file is complete, nothing is fsynced)
+//   reply_flush      socket, bytes
+
+#if !defined(TWMAILER_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(twmailer, name, ##__VA_ARGS__)
+#endif
+#endif
+
+#ifndef PROBE
+//declared only: sizeof marks the arguments used without calling anything
+template<typename... Args> int probeArguments(const Args&...);
+#define PROBE(name, ...) do { (void)sizeof(probeArguments(__VA_ARGS__)); } while (0)
+#endif
+
+#endif
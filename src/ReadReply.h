@@ -0,0 +1,40 @@
+#ifndef READREPLY_H
+#define READREPLY_H
+
+#include <stdlib.h>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// READ reply framing
+// A READ reply can span many receives; the sizes in it tell where it ends:
+//   READ <id>:  OK <size>\n<content>
+//   READ <set>: OK <count>\n then per message "<id> <size>\n<content>" or "<id> ERR\n"
+// single is true for a READ of one id (no ',' or '-' in the argument).
+
+//whether reply, starting with OK, holds the whole READ reply
+inline bool readReplyComplete(const std::string& reply, bool single){
+    size_t end = reply.find('\n');
+    if(end == std::string::npos)
+        return false;
+    unsigned long number = strtoul(reply.c_str() + 2, NULL, 10);
+    size_t pos = end + 1;
+    if(single)
+        return reply.size() >= pos + number;
+
+    for(unsigned long i = 0; i < number; i++){
+        end = reply.find('\n', pos);
+        if(end == std::string::npos)
+            return false;
+        std::string header = reply.substr(pos, end - pos);
+        size_t space = header.find(' ');
+        pos = end + 1;
+        if(space == std::string::npos || header.compare(space + 1, std::string::npos, "ERR") == 0)
+            continue;
+        pos += strtoul(header.c_str() + space + 1, NULL, 10);
+        if(pos > reply.size())
+            return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef SESSIONTRACE_H
+#define SESSIONTRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// Session trace format
+// Written by twmailer-server --trace, read by twmailer-replay. The file
+// starts with TRACE_MAGIC and holds one record per event; numbers are
+// unsigned LEB128 varints, times are microseconds since the trace started.
+//   open:    type session time
+//   command: type session time latency requestBytes replyBytes fieldCount
+//            fieldCount x (kind length [payload])
+//   close:   type session time
+// A field is the text itself (command names, message numbers), a keyed hash
+// of it (user names, so sessions of one user stay related) or only its length
+// (passwords, subjects, bodies, upload tokens).
+
+#define TRACE_MAGIC "TWTRACE1"
+
+enum TraceRecordType { TRACE_OPEN = 1, TRACE_COMMAND = 2, TRACE_CLOSE = 3 };
+enum TraceFieldKind { FIELD_TEXT = 0, FIELD_HASH = 1, FIELD_REDACTED = 2 };
+
+inline void traceVarint(std::string& out, uint64_t value){
+    while(value >= 0x80){
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+//false at the end of the file or on a truncated number
+inline bool readVarint(FILE* file, uint64_t& value){
+    value = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        int c = fgetc(file);
+        if(c == EOF)
+            return false;
+        value |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+#endif
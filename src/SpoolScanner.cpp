@@ -0,0 +1,465 @@
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "SpoolScanner.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// Every thread owns a deque of tasks. It works from the back of its own deque
+// and, once that is empty, steals from the front of the others. A task is
+// either a whole mailbox, which is read and split into batches of files that
+// go back onto the deque, or such a batch. That way one huge mailbox is spread
+// over all cores while many small ones cost no coordination at all.
+
+#define SCAN_BATCH 512
+#define SCAN_HEADER_MAX 65536
+
+struct ScanTask {
+    string user;
+    vector<string> files;       //empty: read the mailbox directory
+};
+
+struct IndexEntry {
+    string file;
+    unsigned long id;
+    off_t size;                 //-1: quarantined, only its number is kept
+    string subject;
+};
+
+struct ScanQueue {
+    pthread_mutex_t mutex;
+    deque<ScanTask> tasks;
+};
+
+struct ScanState;
+
+struct ScanWorker {
+    ScanState* state;
+    int number;
+    pthread_t thread;
+    map<string, vector<IndexEntry>> index;
+};
+
+struct ScanState {
+    const ScanOptions* options;
+    ScanResult* result;
+    vector<ScanQueue> queues;
+    vector<ScanWorker> workers;
+    atomic<long> outstanding{0};
+    //second phase: mailboxes whose index and journal are written
+    vector<pair<string, vector<IndexEntry>>> mailboxes;
+    atomic<size_t> nextMailbox{0};
+};
+
+static unsigned long fileId(const string& filename){
+    if(filename.size() < 5 || filename.compare(filename.size() - 4, 4, ".txt") != 0)
+        return 0;
+    for(size_t i = 0; i < filename.size() - 4; i++){
+        if(filename[i] < '0' || filename[i] > '9')
+            return 0;
+    }
+    return strtoul(filename.c_str(), NULL, 10);
+}
+
+static string mailboxDir(ScanState* state, const string& user){
+    return state->options->spool + "/" + user + "/";
+}
+
+static void pushTask(ScanState* state, int queue, ScanTask task){
+    state->outstanding++;
+    pthread_mutex_lock(&state->queues[queue].mutex);
+    state->queues[queue].tasks.push_back(move(task));
+    pthread_mutex_unlock(&state->queues[queue].mutex);
+}
+
+//own deque from the back, everybody else's from the front
+static bool takeTask(ScanState* state, int self, ScanTask& task){
+    int count = state->queues.size();
+    for(int i = 0; i < count; i++){
+        ScanQueue& queue = state->queues[(self + i) % count];
+        pthread_mutex_lock(&queue.mutex);
+        bool found = !queue.tasks.empty();
+        if(found && i == 0){
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }else if(found){
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        pthread_mutex_unlock(&queue.mutex);
+        if(found)
+            return true;
+    }
+    return false;
+}
+
+//move a file out of the mailbox into <spool>/.quarantine/<user>/
+static void quarantine(ScanState* state, ScanWorker* worker, const string& user, const string& file, const char* reason){
+    state->result->damaged++;
+    if(!state->options->repair){
+        printf("Damaged %s/%s: %s\n", user.c_str(), file.c_str(), reason);
+        return;
+    }
+    string dir = state->options->spool + "/.quarantine";
+    mkdir(dir.c_str(), 0777);
+    dir += "/" + user;
+    mkdir(dir.c_str(), 0777);
+    if(rename((mailboxDir(state, user) + file).c_str(), (dir + "/" + file).c_str()) == -1){
+        perror("quarantine");
+        state->result->errors++;
+        return;
+    }
+    state->result->quarantined++;
+    //its number stays taken, a restored file must not collide
+    if(fileId(file) != 0)
+        worker->index[user].push_back({file, fileId(file), -1, ""});
+    printf("Quarantined %s/%s: %s\n", user.c_str(), file.c_str(), reason);
+}
+
+//replace the receiver line of a message with the mailbox owner
+static bool rewriteReceiver(ScanState* state, const string& user, const string& file, size_t receiverEnd){
+    string path = mailboxDir(state, user) + file;
+    ifstream in(path, ios::binary);
+    string content((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    in.close();
+
+    string tmpPath = mailboxDir(state, user) + "." + file + ".fsck";
+    ofstream out(tmpPath, ios::binary | ios::trunc);
+    out << user << content.substr(receiverEnd);
+    out.close();
+    if(!out || rename(tmpPath.c_str(), path.c_str()) == -1){
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+//check one message: "<receiver>\n<subject>\n<body>" in the receiver's mailbox
+static void checkMessage(ScanState* state, ScanWorker* worker, const string& user, const string& file){
+    string path = mailboxDir(state, user) + file;
+    unsigned long id = fileId(file);
+
+    if(id == 0 && (file.size() < 5 || file.compare(file.size() - 4, 4, ".txt") != 0)){
+        quarantine(state, worker, user, file, "not a message file");
+        return;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd == -1 || fstat(fd, &info) == -1){
+        perror(path.c_str());
+        state->result->errors++;
+        if(fd != -1)
+            close(fd);
+        return;
+    }
+    if(!S_ISREG(info.st_mode)){
+        close(fd);
+        quarantine(state, worker, user, file, "not a regular file");
+        return;
+    }
+
+    //only the two header lines are needed, the body is not read
+    string header;
+    char buffer[4096];
+    size_t receiverEnd = string::npos, subjectEnd = string::npos;
+    ssize_t got;
+    while(subjectEnd == string::npos && header.size() < SCAN_HEADER_MAX
+          && (got = read(fd, buffer, sizeof(buffer))) > 0){
+        header.append(buffer, got);
+        receiverEnd = header.find('\n');
+        if(receiverEnd != string::npos)
+            subjectEnd = header.find('\n', receiverEnd + 1);
+    }
+    close(fd);
+
+    if(receiverEnd == string::npos || subjectEnd == string::npos){
+        quarantine(state, worker, user, file, "missing receiver or subject line");
+        return;
+    }
+    if(header.find('\0') < subjectEnd){
+        quarantine(state, worker, user, file, "binary data in header");
+        return;
+    }
+
+    if(header.compare(0, receiverEnd, user) != 0){
+        state->result->damaged++;
+        if(!state->options->repair){
+            printf("Damaged %s/%s: receiver is not %s\n", user.c_str(), file.c_str(), user.c_str());
+        }else if(rewriteReceiver(state, user, file, receiverEnd)){
+            state->result->repaired++;
+            info.st_size += (off_t)user.size() - (off_t)receiverEnd;
+            printf("Repaired %s/%s: receiver set to %s\n", user.c_str(), file.c_str(), user.c_str());
+        }else{
+            perror(path.c_str());
+            state->result->errors++;
+        }
+    }
+
+    state->result->messages++;
+    if(id == 0)
+        state->result->legacy++;
+    if(state->options->writeIndex || state->options->repair){
+        IndexEntry entry = {file, id, info.st_size, header.substr(receiverEnd + 1, subjectEnd - receiverEnd - 1)};
+        worker->index[user].push_back(move(entry));
+    }
+}
+
+//split a mailbox into batches on our own deque, others steal what we can't do
+static void scanMailbox(ScanState* state, ScanWorker* worker, const string& user){
+    DIR* dir = opendir(mailboxDir(state, user).c_str());
+    if(dir == NULL){
+        //stray files next to the mailboxes are none of our business
+        if(errno == ENOTDIR)
+            return;
+        perror(user.c_str());
+        state->result->errors++;
+        return;
+    }
+    state->result->mailboxes++;
+    worker->index[user];
+
+    ScanTask batch = {user, {}};
+    struct dirent* file;
+    while((file = readdir(dir)) != NULL){
+        if(file->d_name[0] == '.')
+            continue;
+        batch.files.push_back(file->d_name);
+        if(batch.files.size() == SCAN_BATCH){
+            pushTask(state, worker->number, move(batch));
+            batch = {user, {}};
+        }
+    }
+    closedir(dir);
+    if(!batch.files.empty())
+        pushTask(state, worker->number, move(batch));
+}
+
+static void* s_scanWorker(void* arg){
+    ScanWorker* worker = (ScanWorker*)arg;
+    ScanState* state = worker->state;
+    ScanTask task;
+
+    //tasks are only ever added by threads that still hold one, so nothing
+    //outstanding means the scan is done
+    while(state->outstanding > 0){
+        if(!takeTask(state, worker->number, task)){
+            sched_yield();
+            continue;
+        }
+        if(task.files.empty()){
+            scanMailbox(state, worker, task.user);
+        }else{
+            for(const string& file : task.files)
+                checkMessage(state, worker, task.user, file);
+        }
+        state->outstanding--;
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Index and journal
+// <spool>/.index/<user> gets "<file> <size> <subject>" per message, numbered
+// messages first in ascending order. With repair the SYNC journal in
+// <spool>/.sync/<user> is brought in line with the mailbox: files it misses
+// are added, files it still lists but that are gone are removed, and the next
+// message number is raised above every file seen so no number is reused.
+
+static void writeIndex(ScanState* state, const string& user, const vector<IndexEntry>& entries){
+    string dir = state->options->spool + "/.index";
+    mkdir(dir.c_str(), 0777);
+    string path = dir + "/" + user;
+    ofstream out(path + ".tmp", ios::trunc);
+    for(const IndexEntry& entry : entries){
+        if(entry.size < 0)
+            continue;
+        out << entry.file << " " << entry.size << " " << entry.subject << "\n";
+    }
+    out.close();
+    if(!out || rename((path + ".tmp").c_str(), path.c_str()) == -1){
+        perror(path.c_str());
+        state->result->errors++;
+    }
+}
+
+static void reconcileJournal(ScanState* state, const string& user, const vector<IndexEntry>& entries){
+    string dir = state->options->spool + "/.sync";
+    string path = dir + "/" + user;
+
+    map<string, bool> listed;
+    unsigned long modseq = 0, nextId = 1;
+    ifstream in(path);
+    string line;
+    while(getline(in, line)){
+        if(line.compare(0, 8, "# floor ") == 0){
+            modseq = max(modseq, strtoul(line.c_str() + 8, NULL, 10));
+            continue;
+        }
+        if(line.compare(0, 9, "# nextid ") == 0){
+            nextId = max(nextId, strtoul(line.c_str() + 9, NULL, 10));
+            continue;
+        }
+        if(line[0] == '#')
+            continue;
+        size_t op = line.find(' ');
+        if(op == string::npos || line.size() < op + 4)
+            continue;
+        modseq = max(modseq, strtoul(line.c_str(), NULL, 10));
+        string file = line.substr(op + 3);
+        listed[file] = line[op + 1] == '+';
+        nextId = max(nextId, fileId(file) + 1);
+    }
+    in.close();
+
+    string added;
+    unsigned long highest = nextId;
+    for(const IndexEntry& entry : entries){
+        highest = max(highest, entry.id + 1);
+        if(entry.size < 0)
+            continue;
+        auto it = listed.find(entry.file);
+        if(it == listed.end() || !it->second)
+            added += to_string(++modseq) + " + " + entry.file + "\n";
+        if(it != listed.end())
+            it->second = false;
+    }
+    for(auto& file : listed){
+        if(file.second)
+            added += to_string(++modseq) + " - " + file.first + "\n";
+    }
+    if(highest > nextId)
+        added += "# nextid " + to_string(highest) + "\n";
+    if(added.empty())
+        return;
+
+    mkdir(dir.c_str(), 0777);
+    ofstream out(path, ios::app);
+    out << added;
+    out.close();
+    if(!out){
+        perror(path.c_str());
+        state->result->errors++;
+        return;
+    }
+    printf("Journal of %s updated\n", user.c_str());
+}
+
+static bool indexOrder(const IndexEntry& a, const IndexEntry& b){
+    if((a.id == 0) != (b.id == 0))
+        return b.id == 0;
+    return a.id != b.id ? a.id < b.id : a.file < b.file;
+}
+
+static void* s_indexWorker(void* arg){
+    ScanState* state = (ScanState*)arg;
+    size_t i;
+    while((i = state->nextMailbox++) < state->mailboxes.size()){
+        string& user = state->mailboxes[i].first;
+        vector<IndexEntry>& entries = state->mailboxes[i].second;
+        sort(entries.begin(), entries.end(), indexOrder);
+        if(state->options->writeIndex)
+            writeIndex(state, user, entries);
+        if(state->options->repair)
+            reconcileJournal(state, user, entries);
+    }
+    return NULL;
+}
+
+int scanSpool(const ScanOptions& options, ScanResult& result){
+    DIR* dir = opendir(options.spool.c_str());
+    if(dir == NULL){
+        perror(options.spool.c_str());
+        return -1;
+    }
+
+    int threads = options.threads > 0 ? options.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1)
+        threads = 1;
+
+    ScanState state;
+    state.options = &options;
+    state.result = &result;
+    state.queues = vector<ScanQueue>(threads);
+    state.workers = vector<ScanWorker>(threads);
+    for(int i = 0; i < threads; i++){
+        pthread_mutex_init(&state.queues[i].mutex, NULL);
+        state.workers[i].state = &state;
+        state.workers[i].number = i;
+    }
+
+    //mailboxes are dealt out round robin, stealing evens out the rest
+    struct dirent* entry;
+    int next = 0;
+    while((entry = readdir(dir)) != NULL){
+        if(entry->d_name[0] == '.')
+            continue;
+        if(entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+            continue;
+        pushTask(&state, next++ % threads, {entry->d_name, {}});
+    }
+    closedir(dir);
+
+    size_t started = 0;
+    for(; started < state.workers.size(); started++){
+        if(pthread_create(&state.workers[started].thread, NULL, s_scanWorker, &state.workers[started]) != 0){
+            perror("pthread_create");
+            break;
+        }
+    }
+    //the threads use state, so they are joined even if not all could start
+    for(size_t i = 0; i < started; i++)
+        pthread_join(state.workers[i].thread, NULL);
+    if(started < state.workers.size())
+        return -1;
+
+    if(!options.writeIndex && !options.repair)
+        return 0;
+
+    //a mailbox may have been checked by several threads, merge its parts
+    map<string, vector<IndexEntry>> merged;
+    for(ScanWorker& worker : state.workers){
+        for(auto& mailbox : worker.index){
+            vector<IndexEntry>& entries = merged[mailbox.first];
+            move(mailbox.second.begin(), mailbox.second.end(), back_inserter(entries));
+        }
+        worker.index.clear();
+    }
+    for(auto& mailbox : merged)
+        state.mailboxes.push_back(make_pair(mailbox.first, move(mailbox.second)));
+
+    for(started = 0; started < state.workers.size(); started++){
+        if(pthread_create(&state.workers[started].thread, NULL, s_indexWorker, &state) != 0){
+            perror("pthread_create");
+            break;
+        }
+    }
+    //without all threads this one takes mailboxes from the same counter
+    if(started < state.workers.size())
+        s_indexWorker(&state);
+    for(size_t i = 0; i < started; i++)
+        pthread_join(state.workers[i].thread, NULL);
+
+    for(ScanQueue& queue : state.queues)
+        pthread_mutex_destroy(&queue.mutex);
+    return 0;
+}
+
+void printScanResult(const ScanResult& result){
+    printf("Spool: %lu mailboxes, %lu messages (%lu unnumbered), %lu damaged, %lu repaired, %lu quarantined, %lu errors\n",
+           result.mailboxes.load(), result.messages.load(), result.legacy.load(), result.damaged.load(),
+           result.repaired.load(), result.quarantined.load(), result.errors.load());
+}
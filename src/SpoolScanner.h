@@ -0,0 +1,37 @@
+#ifndef SPOOLSCANNER_H
+#define SPOOLSCANNER_H
+
+#include <atomic>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// Parallel spool scanner
+// Walks <spool>/<user>/*.txt with a pool of work-stealing threads and checks
+// every message against the layout saveMessage writes:
+//   <receiver>\n<subject>\n<body>
+// stored as <id>.txt in the receiver's mailbox. Used by twmailer-fsck and
+// by twmailer-server --fsck.
+
+struct ScanOptions {
+    std::string spool;
+    int threads;                //0 = one per core
+    bool repair;                //fix headers, quarantine broken files
+    bool writeIndex;            //write <spool>/.index/<user>
+};
+
+struct ScanResult {
+    std::atomic<unsigned long> mailboxes{0};
+    std::atomic<unsigned long> messages{0};
+    std::atomic<unsigned long> legacy{0};       //<subject>.txt, numbered by the server
+    std::atomic<unsigned long> damaged{0};
+    std::atomic<unsigned long> repaired{0};
+    std::atomic<unsigned long> quarantined{0};
+    std::atomic<unsigned long> errors{0};
+};
+
+//returns 0 if the scan ran; problems are counted in result
+int scanSpool(const ScanOptions& options, ScanResult& result);
+
+void printScanResult(const ScanResult& result);
+
+#endif
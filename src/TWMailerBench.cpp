@@ -0,0 +1,314 @@
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <ftw.h>
+#include <functional>
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMailer benchmarks
+// Microbenchmarks of the server's hot paths, run by "make bench". The server
+// is a single translation unit without a header, so it is compiled into this
+// program with its main renamed and its functions are called directly.
+//
+// Every benchmark repeats its operation until MIN_TIME has passed and prints
+//   ns/op        wall clock time per operation
+//   syscalls/op  counted exactly with ptrace in a forked copy that runs
+//                SYSCALL_ITERATIONS operations, so tracing costs no time above
+//   allocs/op    malloc, calloc and realloc calls of the benchmark thread
+//
+// The spool lives on tmpfs (/dev/shm) so the numbers show our code and the
+// syscalls it makes rather than the disk. LDAP is replaced by an in-memory
+// authenticator. Arguments filter benchmarks by name prefix.
+
+#define main twmailerServerMain
+#include "TWMailerServer.cpp"
+#undef main
+
+#define MIN_TIME_NS 200000000LL
+#define SYSCALL_ITERATIONS 64
+
+///////////////////////////////////////////////////////////////////////////////
+// ALLOCATION COUNTING
+// glibc lets a program replace malloc; the real one stays reachable as
+// __libc_malloc. operator new ends up here as well.
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+thread_local unsigned long allocations = 0;
+
+extern "C" void* malloc(size_t size){
+    allocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size){
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size){
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+vector<string> filters;
+int replySocket = -1;           //replies of the server functions go here
+map<string, string> fakeUsers;
+
+long long nowNanos(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool selected(const string& name){
+    if(filters.empty())
+        return true;
+    for(const string& filter : filters){
+        if(name.compare(0, filter.size(), filter) == 0)
+            return true;
+    }
+    return false;
+}
+
+//syscalls per operation, from a traced child so the parent keeps its state
+double countSyscalls(const function<void()>& op){
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0){
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        for(int i = 0; i < SYSCALL_ITERATIONS; i++)
+            op();
+        _exit(0);
+    }
+
+    int status;
+    if(pid == -1 || waitpid(pid, &status, 0) == -1)
+        return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+    //every syscall stops on entry and on exit, exit_group only on entry
+    long stops = 0;
+    int signal = 0;
+    while(ptrace(PTRACE_SYSCALL, pid, NULL, signal) != -1 && waitpid(pid, &status, 0) != -1){
+        if(WIFEXITED(status) || WIFSIGNALED(status))
+            break;
+        signal = 0;
+        if(WSTOPSIG(status) == (SIGTRAP | 0x80))
+            stops++;
+        else
+            signal = WSTOPSIG(status);
+    }
+    return ((stops + 1) / 2 - 1) / (double)SYSCALL_ITERATIONS;
+}
+
+//counts below zero were not measured
+void report(const string& name, long long iterations, long long elapsed, double syscalls, double allocs){
+    char calls[32], allocations[32];
+    snprintf(calls, sizeof(calls), syscalls < 0 ? "-" : "%.1f", syscalls);
+    snprintf(allocations, sizeof(allocations), allocs < 0 ? "-" : "%.1f", allocs);
+    printf("%-36s %12.0f ns %12lld %12s %12s\n", name.c_str(), (double)elapsed / iterations, iterations, calls, allocations);
+}
+
+//run op until MIN_TIME_NS has passed, doubling the iterations each round
+void benchmark(const string& name, const function<void()>& op){
+    if(!selected(name))
+        return;
+    op();
+
+    long long iterations = 1, elapsed = 0;
+    unsigned long allocs = 0;
+    while(true){
+        unsigned long before = allocations;
+        long long start = nowNanos();
+        for(long long i = 0; i < iterations; i++)
+            op();
+        elapsed = nowNanos() - start;
+        allocs = allocations - before;
+        if(elapsed >= MIN_TIME_NS || iterations >= (1LL << 30))
+            break;
+        iterations *= 2;
+    }
+    report(name, iterations, elapsed, countSyscalls(op), (double)allocs / iterations);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FIXTURES
+
+//reads and throws away whatever the server functions send
+void* s_drain(void* arg){
+    int fd = (int)(intptr_t)arg;
+    char buffer[1 << 16];
+    while(read(fd, buffer, sizeof(buffer)) > 0);
+    return NULL;
+}
+
+int openReplySocket(){
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1){
+        perror("socketpair");
+        return -1;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, s_drain, (void*)(intptr_t)fds[1]);
+    pthread_detach(thread);
+    return fds[0];
+}
+
+//the in-memory stand-in for LDAP
+int fakeAuthenticate(vector<string> msg){
+    if(msg.size() < 3)
+        return -1;
+    auto it = fakeUsers.find(msg[1]);
+    return it != fakeUsers.end() && it->second == msg[2] ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int removeEntry(const char* path, const struct stat*, int, struct FTW*){
+    return remove(path);
+}
+
+//a mailbox holding count messages, filled through saveMessage
+string fillMailbox(size_t count){
+    string user = "bench" + to_string(count);
+    string body(512, 'x');
+    for(size_t i = 0; i < count; i++)
+        saveMessage({"SEND", user, "subject " + to_string(i), body, "."});
+    return user;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BENCHMARKS
+
+void benchParser(){
+    const char* login = "LOGIN\nif20b000\nsecret";
+    string send = "SEND\nif20b000\nmeeting tomorrow\n" + string(1000, 'x') + "\n.";
+    const char* read = "READ\n1,3,5-9";
+
+    benchmark("parseCommand/LOGIN", [&]{ parseCommand(login); });
+    benchmark("parseCommand/SEND_1k", [&]{ parseCommand(send.c_str()); });
+    benchmark("parseCommand/READ_set", [&]{ parseCommand(read); });
+}
+
+void benchSpool(size_t count){
+    string suffix = "/" + to_string(count);
+    if(!selected("saveMessage" + suffix) && !selected("readMessage" + suffix) && !selected("listFiles" + suffix))
+        return;
+
+    string user = fillMailbox(count);
+    string middle = to_string(count / 2 + 1);
+    string body(512, 'x');
+
+    size_t budget = cacheBudget;
+    cacheBudget = 0;
+    benchmark("readMessage" + suffix, [&]{
+        readMessage({"READ", middle}, &replySocket, user);
+    });
+    cacheBudget = budget;
+    benchmark("readMessage" + suffix + "/cached", [&]{
+        readMessage({"READ", middle}, &replySocket, user);
+    });
+
+    string dir = mailboxPath(user);
+    benchmark("listFiles" + suffix, [&]{ listFiles(dir.c_str()); });
+
+    //last, every save makes the mailbox bigger
+    benchmark("saveMessage" + suffix, [&]{
+        saveMessage({"SEND", user, "subject", body, "."});
+    });
+}
+
+#define BLACKLIST_LOOKUPS 200000     //per thread
+
+//one in 1024 operations blacklists, the rest look up
+void* s_blacklistWorker(void* arg){
+    long number = (long)arg;
+    for(long i = 0; i < BLACKLIST_LOOKUPS; i++){
+        string address = "10.0." + to_string(number) + "." + to_string(i & 511);
+        if((i & 1023) == 0)
+            blackListUser(address);
+        else
+            checkBlacklisted(address);
+    }
+    return NULL;
+}
+
+void benchBlacklist(int threads){
+    string name = "checkBlacklisted/threads:" + to_string(threads);
+    if(!selected(name))
+        return;
+
+    for(int i = 0; i < 256; i++)
+        blackList["10.0.0." + to_string(i)] = time(nullptr);
+
+    //blackListUser prints every entry it adds
+    cout.setstate(ios::failbit);
+    vector<pthread_t> workers(threads);
+    long long start = nowNanos();
+    for(long t = 0; t < threads; t++)
+        pthread_create(&workers[t], NULL, s_blacklistWorker, (void*)t);
+    for(pthread_t worker : workers)
+        pthread_join(worker, NULL);
+    long long elapsed = nowNanos() - start;
+    cout.clear();
+
+    //time per operation as seen by one thread; counting needs a single thread
+    report(name, (long long)BLACKLIST_LOOKUPS * threads, elapsed * threads, -1, -1);
+}
+
+void benchLogin(){
+    authenticator = fakeAuthenticate;
+    fakeUsers["if20b000"] = "secret";
+
+    Session session = Session();
+    session.socket = replySocket;
+    session.clientIP = "127.0.0.1";
+
+    benchmark("loginUser/ok", [&]{
+        loginUser({"LOGIN", "if20b000", "secret"}, &session);
+        session.authenticatedUser.clear();
+    });
+    benchmark("loginUser/wrong_password", [&]{
+        loginUser({"LOGIN", "if20b000", "wrong"}, &session);
+        session.loginAttempts = 0;
+    });
+}
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+        filters.push_back(argv[i]);
+
+    //tmpfs if there is one
+    struct stat info;
+    string base = stat("/dev/shm", &info) == 0 ? "/dev/shm" : "/tmp";
+    dirname = base + "/twmailer-bench-" + to_string(getpid());
+    if (mkdir(dirname.c_str(), 0777) == -1)
+    {
+        perror(dirname.c_str());
+        return EXIT_FAILURE;
+    }
+    initMessageCache();
+    if ((replySocket = openReplySocket()) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Spool: %s\n", dirname.c_str());
+    printf("%-36s %15s %12s %12s %12s\n", "Benchmark", "Time", "Iterations", "Syscalls/op", "Allocs/op");
+    printf("%s\n", string(91, '-').c_str());
+
+    benchParser();
+    for (size_t count : {1, 1000, 100000})
+        benchSpool(count);
+    for (int threads : {1, 4, 16})
+        benchBlacklist(threads);
+    benchLogin();
+
+    nftw(dirname.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    return EXIT_SUCCESS;
+}
@@ -6,9 +6,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <map>
 #include "mypw.h"
+#include "ReadReply.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -18,6 +24,127 @@ using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+//local copy of the mailbox headers (message number and subject), kept up
+//to date with SYNC
+string headerCachePath(string user)
+{
+   const char *home = getenv("HOME");
+   return string(home != NULL ? home : ".") + "/.twmailer-" + user + ".cache";
+}
+
+//first line is the SYNC token, then "<id> <subject>" per line
+void loadHeaderCache(string user, string &token, map<unsigned long, string> &headers)
+{
+   ifstream cache(headerCachePath(user));
+   string line;
+   token = "0";
+   headers.clear();
+   if (getline(cache, line) && !line.empty())
+   {
+      token = line;
+   }
+   while (getline(cache, line))
+   {
+      size_t space = line.find(' ');
+      unsigned long id = strtoul(line.c_str(), NULL, 10);
+      if (id != 0)
+      {
+         headers[id] = space == string::npos ? "" : line.substr(space + 1);
+      }
+   }
+}
+
+void saveHeaderCache(string user, string token, const map<unsigned long, string> &headers)
+{
+   ofstream cache(headerCachePath(user), ios::trunc);
+   cache << token << "\n";
+   for (auto &header : headers)
+   {
+      cache << header.first << " " << header.second << "\n";
+   }
+}
+
+//send one command and return the server's short reply, "" on error
+string request(int socket, const string &command)
+{
+   char buffer[BUF];
+   if (send(socket, command.data(), command.size(), 0) == -1)
+   {
+      return "";
+   }
+   int size = recv(socket, buffer, BUF - 1, 0);
+   if (size <= 0)
+   {
+      return "";
+   }
+   return string(buffer, size);
+}
+
+//upload a file in chunks. The token is kept in <file>.twupload, so running
+//UPLOAD again for the same file after a lost connection continues it.
+int uploadFile(int socket, string receiver, string subject, string path)
+{
+   struct stat info;
+   ifstream file(path, ios::binary);
+   if (stat(path.c_str(), &info) == -1 || !file.is_open())
+   {
+      perror("upload file");
+      return -1;
+   }
+
+   string statePath = path + ".twupload";
+   string token = "";
+   ifstream state(statePath);
+   getline(state, token);
+   state.close();
+
+   string reply = token.empty()
+                      ? request(socket, "UPLOAD\n" + receiver + "\n" + subject + "\n" + to_string(info.st_size) + "\n")
+                      : request(socket, "UPLOAD\n" + token + "\n");
+   string status;
+   unsigned long offset = 0;
+   stringstream(reply) >> status >> token >> offset;
+   if (status != "OK")
+   {
+      printf("<< %s\n", reply.c_str());
+      remove(statePath.c_str());
+      return -1;
+   }
+   ofstream(statePath) << token << "\n";
+
+   char chunk[65536];
+   file.seekg(offset);
+   while (offset < (unsigned long)info.st_size)
+   {
+      file.read(chunk, sizeof(chunk));
+      string data = "DATA " + token + " " + to_string(offset) + " " + to_string(file.gcount()) + "\n";
+      data.append(chunk, file.gcount());
+
+      reply = request(socket, data);
+      stringstream(reply) >> status >> offset;
+      if (status != "OK")
+      {
+         printf("<< upload interrupted at %lu bytes, run UPLOAD again to continue\n", offset);
+         return -1;
+      }
+      printf("\r%lu / %ld bytes", offset, (long)info.st_size);
+      fflush(stdout);
+      file.clear();
+      file.seekg(offset);
+   }
+   printf("\n");
+
+   reply = request(socket, "COMMIT\n" + token + "\n");
+   printf("<< %s\n", reply.c_str());
+   if (reply.compare(0, 2, "OK") == 0)
+   {
+      remove(statePath.c_str());
+   }
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 int main(int argc, char **argv)
 {
 
@@ -32,6 +159,14 @@ int main(int argc, char **argv)
    struct sockaddr_in address;
    int size;
    bool isQuit = false;
+   bool isWatch = false;
+   bool isSync = false;
+   bool isRead = false;
+   bool readSingle = false;   //READ of one id, see ReadReply.h
+   string user = "";
+   string loginUser = "";
+   string token = "0";
+   map<unsigned long, string> cachedHeaders;
 
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A SOCKET
@@ -113,6 +248,7 @@ int main(int argc, char **argv)
          input += line;
          printf(">> ");
          getline(cin, line);
+         loginUser = line;
          line += "\n";
          input += line;
          printf(">> ");
@@ -135,23 +271,51 @@ int main(int argc, char **argv)
          //system("clear");
       }
 
+      //large messages are streamed from a file instead of typed in
+      else if("UPLOAD" == line){
+         string receiver, subject, path;
+         printf(">> Receiver: ");
+         getline(cin, receiver);
+         printf(">> Subject: ");
+         getline(cin, subject);
+         printf(">> File: ");
+         getline(cin, path);
+         uploadFile(create_socket, receiver, subject, path);
+         continue;
+      }
+
       else if("LIST" == line){
          line += "\n";
          input += line;
       }
 
+      //only ask for changes since the last SYNC, see the header cache
+      else if("SYNC" == line){
+         loadHeaderCache(user, token, cachedHeaders);
+         input = "SYNC\n" + token + "\n";
+         isSync = true;
+      }
+
+      else if("WATCH" == line){
+         line += "\n";
+         input += line;
+         isWatch = true;
+      }
+
       else if("READ" == line || "DEL" == line){
+         isRead = "READ" == line;
          line += "\n";
          input += line;
          printf(">> ");
          getline(cin, line);
+         readSingle = line.find_first_of(",-") == string::npos;
          line += "\n";
          input += line;
       }
 
       //convert string to char*
       const char* inp_str_const = input.c_str();
-      char* inp_str = new char[sizeof(inp_str_const) + 100];
+      char* inp_str = new char[input.size() + 1];
       strcpy(inp_str, inp_str_const);
       
       int size = strlen(inp_str);
@@ -175,7 +339,9 @@ int main(int argc, char **argv)
       // https://man7.org/linux/man-pages/man2/send.2.html
       // send will fail if connection is closed, but does not set
       // the error of send, but still the count of bytes sent
-      if ((send(create_socket, inp_str, size, 0)) == -1) 
+      int sent = send(create_socket, inp_str, size, 0);
+      delete[] inp_str;
+      if (sent == -1) 
       {
          // in case the server is gone offline we will still not enter
          // this part of code: see docs: https://linux.die.net/man/3/send
@@ -195,6 +361,59 @@ int main(int argc, char **argv)
          break;
       }
 
+      //////////////////////////////////////////////////////////////////////
+      // SYNC
+      // <count> <epoch>-<modseq>[ FULL] and count lines "+ <file> <subject>" or "- <file>"
+      if(isSync){
+         isSync = false;
+         string reply = "";
+         size_t lines = 0;
+         do{
+            size = recv(create_socket, buffer, BUF - 1, 0);
+            if(size <= 0)
+               break;
+            reply.append(buffer, size);
+            lines = 0;
+            for(char c : reply)
+               lines += c == '\n';
+         }while(reply.compare(0, 3, "ERR") != 0 &&
+                (lines == 0 || lines < strtoul(reply.c_str(), NULL, 10) + 1));
+         if(size <= 0){
+            printf("Server closed remote socket\n");
+            break;
+         }
+
+         stringstream ss(reply);
+         string header, change;
+         getline(ss, header);
+         stringstream headerStream(header);
+         unsigned long count = 0;
+         string full = "";
+         if(reply.compare(0, 3, "ERR") == 0 || !(headerStream >> count >> token)){
+            printf("<< %s\n", reply.c_str());
+            continue;
+         }
+         headerStream >> full;
+         if(full == "FULL")
+            cachedHeaders.clear();
+         while(getline(ss, change)){
+            if(change.size() < 3)
+               continue;
+            unsigned long id = strtoul(change.c_str() + 2, NULL, 10);
+            size_t subject = change.find(' ', 2);
+            if(change[0] == '-')
+               cachedHeaders.erase(id);
+            else if(id != 0)
+               cachedHeaders[id] = subject == string::npos ? "" : change.substr(subject + 1);
+         }
+         saveHeaderCache(user, token, cachedHeaders);
+
+         printf("<< %lu changes, %zu messages\n", count, cachedHeaders.size());
+         for(auto &header : cachedHeaders)
+            printf("%lu %s\n", header.first, header.second.c_str());
+         continue;
+      }
+
       //////////////////////////////////////////////////////////////////////
       // RECEIVE FEEDBACK
       // consider: reconnect handling might be appropriate in somes cases
@@ -221,8 +440,71 @@ int main(int argc, char **argv)
       else
       {
          buffer[size] = '\0';
-         printf("<< %s\n", buffer); // ignore error
+         printf("<< %s", buffer); // ignore error
+
+         //a READ reply may not fit into one buffer, its sizes tell the end
+         string reply(buffer, size);
+         while(isRead && reply.compare(0, 2, "OK") == 0 && !readReplyComplete(reply, readSingle) &&
+               (size = recv(create_socket, buffer, BUF - 1, 0)) > 0){
+            buffer[size] = '\0';
+            printf("%s", buffer);
+            reply.append(buffer, size);
+         }
+         printf("\n");
+      }
+      isRead = false;
+
+      if(!loginUser.empty()){
+         if(strcmp(buffer, "OK") == 0)
+            user = loginUser;
+         loginUser = "";
+      }
+
+      //////////////////////////////////////////////////////////////////////
+      // WATCH
+      // print pushed notifications until ENTER is pressed, which ends it.
+      // Subjects may contain "OK", so only an OK after the last complete
+      // line closes WATCH; the opening OK can arrive with the first lines
+      if(isWatch && strncmp(buffer, "OK", 2) == 0){
+         printf("Watching for new messages, press ENTER to stop\n");
+         string tail = buffer + 2;
+         while(true){
+            struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {create_socket, POLLIN, 0}};
+            if(poll(fds, 2, -1) == -1){
+               perror("poll error");
+               break;
+            }
+            if(fds[1].revents & (POLLIN | POLLHUP)){
+               size = recv(create_socket, buffer, BUF - 1, 0);
+               if(size <= 0){
+                  printf("Server closed remote socket\n");
+                  isQuit = true;
+                  break;
+               }
+               buffer[size] = '\0';
+               printf("<< %s", buffer);
+               tail.append(buffer, size);
+               tail.erase(0, tail.find_last_of('\n') + 1);
+            }
+            if(fds[0].revents & POLLIN){
+               getline(cin, line);
+               send(create_socket, "DONE\n", 5, 0);
+               //notifications may still arrive before the final OK
+               while(tail != "OK"){
+                  size = recv(create_socket, buffer, BUF - 1, 0);
+                  if(size <= 0)
+                     break;
+                  buffer[size] = '\0';
+                  printf("<< %s", buffer);
+                  tail.append(buffer, size);
+                  tail.erase(0, tail.find_last_of('\n') + 1);
+               }
+               printf("\n");
+               break;
+            }
+         }
       }
+      isWatch = false;
 
    } while (isQuit != true);
 
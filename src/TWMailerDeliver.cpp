@@ -0,0 +1,102 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMailer deliver
+// Hands a message to the local socket of twmailer-server (--local-socket).
+// The body is not sent, only its file descriptor: the server copies the file
+// (or reads the pipe) itself. Without a file the body is read from stdin, so
+//   some-job | twmailer-deliver /run/twmailer.sock admin "nightly report"
+// works from cron. Prints the message number on success.
+
+#define BUF 1024
+
+int main(int argc, char** argv)
+{
+    if (argc < 4) {
+        cerr << "Missing arguments!" << endl;
+        cerr << "Usage: " << argv[0] << " <socket> <receiver> <subject> [body-file]" << endl;
+        return EXIT_FAILURE;
+    }
+
+    int body = STDIN_FILENO;
+    if (argc > 4 && (body = open(argv[4], O_RDONLY)) == -1)
+    {
+        perror(argv[4]);
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr*)&address, sizeof(address)) == -1)
+    {
+        perror("Connect error - no server available");
+        return EXIT_FAILURE;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // SEND THE DESCRIPTOR (SCM_RIGHTS)
+    // https://man7.org/linux/man-pages/man7/unix.7.html
+    string text = string("DELIVER\n") + argv[2] + "\n" + argv[3];
+    struct iovec iov;
+    iov.iov_base = (void*)text.c_str();
+    iov.iov_len = text.size();
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &body, sizeof(int));
+
+    //an untrusted sender is refused before it gets to send, read why
+    bool sent = sendmsg(sock, &msg, MSG_NOSIGNAL) != -1;
+    int sendError = errno;
+
+    char buffer[BUF];
+    ssize_t size = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    close(sock);
+    if (size <= 0)
+    {
+        if (sent)
+            cerr << "No answer from server" << endl;
+        else
+            cerr << "sendmsg: " << strerror(sendError) << endl;
+        return EXIT_FAILURE;
+    }
+    buffer[size] = '\0';
+
+    if (strncmp(buffer, "OK ", 3) != 0)
+    {
+        cerr << buffer << endl;
+        return EXIT_FAILURE;
+    }
+    printf("%s\n", buffer + 3);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include "SpoolScanner.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMailer fsck
+// Checks every message in a mail spool in parallel. Without --repair it only
+// reports; with --repair broken receiver lines are fixed, unreadable files
+// are moved to <spool>/.quarantine and the SYNC journals are brought in line
+// with the mailboxes. Run it while no server uses the spool, or start the
+// server with --fsck instead.
+// Exit status: 0 clean or all repaired, 1 damage left, 2 scan failed.
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        cerr << "Missing arguments!" << endl;
+        cerr << "Usage: " << argv[0] << " <mail-spool-directoryname> [--repair] [--threads N] [--no-index]" << endl;
+        return 2;
+    }
+
+    ScanOptions options = {argv[1], 0, false, true};
+    for (int i = 2; i < argc; i++)
+    {
+        string option = argv[i];
+        if (option == "--repair")
+            options.repair = true;
+        else if (option == "--no-index")
+            options.writeIndex = false;
+        else if (option == "--threads" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            options.threads = atoi(argv[++i]);
+        else
+        {
+            cerr << "Invalid option: " << option << endl;
+            return 2;
+        }
+    }
+
+    ScanResult result;
+    if (scanSpool(options, result) == -1)
+    {
+        return 2;
+    }
+    printScanResult(result);
+
+    if (result.errors > 0)
+        return 2;
+    return result.damaged > result.repaired + result.quarantined ? 1 : 0;
+}
@@ -0,0 +1,614 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <set>
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMailer migrate
+// Copies mailboxes between storage formats:
+//   files:DIR   the spool layout of twmailer-server, DIR/<user>/<id>.txt
+//               (messages of the old <subject>.txt layout get new numbers)
+//   log:DIR     one append-only segment per user, DIR/<user>.log, holding
+//               "<id> <length>\n<message>\n" records
+//   mbox:DIR    export only, DIR/<user>.mbox in mboxrd format
+// Messages stream through reader -> transform -> writer threads. Every stage
+// is split into lanes and a user always uses the same lane. Each lane has one
+// reader that reads its mailboxes one after the other, so a mailbox passes
+// through in order and in one piece while different lanes move in parallel. The
+// queues between the stages are bounded: a slow writer stops the readers
+// instead of filling memory. Finished mailboxes are appended to a checkpoint
+// file and skipped when the tool is started again; a mailbox that was cut
+// off is copied again from the start.
+
+#define DEFAULT_QUEUE 64        //messages per lane and stage
+
+///////////////////////////////////////////////////////////////////////////////
+
+enum Format { FILES, SEGMENT_LOG, MBOX };
+
+struct Store {
+    Format format;
+    string dir;
+};
+
+//a message or a marker travelling down a lane
+struct Item {
+    enum { MESSAGE, END_OF_MAILBOX, STOP } kind;
+    string user;
+    unsigned long id;
+    time_t date;
+    string content;
+};
+
+//bounded queue between two stages
+struct Lane {
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    deque<Item> items;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+Store source, target;
+string checkpointPath;
+size_t queueDepth = DEFAULT_QUEUE;
+int laneCount = 0;
+
+vector<string> users;
+vector<Lane> transformLanes, writeLanes;
+
+set<string> finished;
+pthread_mutex_t checkpointMutex = PTHREAD_MUTEX_INITIALIZER;
+
+atomic<unsigned long> messagesCopied{0};
+atomic<unsigned long> bytesCopied{0};
+atomic<int> failures{0};
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool parseStore(string spec, Store& store);
+vector<string> listUsers(const Store& store);
+void loadCheckpoint();
+void markFinished(string user);
+void initLane(Lane& lane);
+void push(Lane& lane, Item item);
+Item pop(Lane& lane);
+size_t laneOf(const string& user);
+unsigned long messageId(const string& filename);
+bool readFile(string path, string& content, time_t& date);
+unsigned long journalNextId(string user);
+bool readFiles(string user, Lane& lane);
+bool readSegmentLog(string user, Lane& lane);
+void toMbox(Item& item);
+void* s_reader(void* arg);
+void* s_transformer(void* arg);
+bool writeAll(int fd, const string& data);
+bool writeMessage(const Item& item, int& fd, string& openUser);
+bool syncMailbox(string user, int fd, const string& openUser);
+void* s_writer(void* arg);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        cerr << "Missing arguments!" << endl;
+        cerr << "Usage: " << argv[0] << " <files:DIR|log:DIR> <files:DIR|log:DIR|mbox:DIR> [options]" << endl;
+        cerr << "Options: --user NAME --threads N --queue N --checkpoint FILE" << endl;
+        return EXIT_FAILURE;
+    }
+    if (!parseStore(argv[1], source) || !parseStore(argv[2], target))
+    {
+        cerr << "Stores are given as files:DIR, log:DIR or mbox:DIR" << endl;
+        return EXIT_FAILURE;
+    }
+    if (source.format == MBOX)
+    {
+        cerr << "mbox can only be exported to" << endl;
+        return EXIT_FAILURE;
+    }
+
+    vector<string> selected;
+    for (int i = 3; i < argc; i++)
+    {
+        string option = argv[i];
+        if (i + 1 >= argc)
+        {
+            cerr << "Invalid option: " << option << endl;
+            return EXIT_FAILURE;
+        }
+        if (option == "--user")
+            selected.push_back(argv[++i]);
+        else if (option == "--checkpoint")
+            checkpointPath = argv[++i];
+        else if (option == "--threads" && atoi(argv[i + 1]) > 0)
+            laneCount = atoi(argv[++i]);
+        else if (option == "--queue" && atoi(argv[i + 1]) > 0)
+            queueDepth = atoi(argv[++i]);
+        else
+        {
+            cerr << "Invalid option: " << option << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (mkdir(target.dir.c_str(), 0777) == -1 && errno != EEXIST)
+    {
+        perror(target.dir.c_str());
+        return EXIT_FAILURE;
+    }
+    if (checkpointPath.empty())
+        checkpointPath = target.dir + "/.migrate-checkpoint";
+    loadCheckpoint();
+
+    for (string user : selected.empty() ? listUsers(source) : selected)
+    {
+        if (finished.count(user) == 0)
+            users.push_back(user);
+    }
+    printf("%zu mailboxes to migrate, %zu already done\n", users.size(), finished.size());
+
+    if (laneCount == 0)
+        laneCount = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    transformLanes = vector<Lane>(laneCount);
+    writeLanes = vector<Lane>(laneCount);
+    for (int i = 0; i < laneCount; i++)
+    {
+        initLane(transformLanes[i]);
+        initLane(writeLanes[i]);
+    }
+
+    //one thread per lane and stage
+    vector<pthread_t> readers(laneCount), transformers(laneCount), writers(laneCount);
+    for (long i = 0; i < laneCount; i++)
+    {
+        if (pthread_create(&writers[i], NULL, s_writer, (void*)i) != 0 ||
+            pthread_create(&transformers[i], NULL, s_transformer, (void*)i) != 0 ||
+            pthread_create(&readers[i], NULL, s_reader, (void*)i) != 0)
+        {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    //once every mailbox is read the lanes are drained and closed
+    for (pthread_t thread : readers)
+        pthread_join(thread, NULL);
+    for (Lane& lane : transformLanes)
+        push(lane, {Item::STOP, "", 0, 0, ""});
+    for (pthread_t thread : transformers)
+        pthread_join(thread, NULL);
+    for (pthread_t thread : writers)
+        pthread_join(thread, NULL);
+
+    printf("Migrated %lu messages (%lu bytes), %d mailboxes failed\n",
+           messagesCopied.load(), bytesCopied.load(), failures.load());
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+bool parseStore(string spec, Store& store){
+    size_t colon = spec.find(':');
+    if(colon == string::npos || colon + 1 == spec.size())
+        return false;
+    string format = spec.substr(0, colon);
+    store.dir = spec.substr(colon + 1);
+    if(format == "files")
+        store.format = FILES;
+    else if(format == "log")
+        store.format = SEGMENT_LOG;
+    else if(format == "mbox")
+        store.format = MBOX;
+    else
+        return false;
+    return true;
+}
+
+//mailbox directories or <user>.log segments
+vector<string> listUsers(const Store& store){
+    vector<string> names;
+    DIR* dir = opendir(store.dir.c_str());
+    if(dir == NULL){
+        perror(store.dir.c_str());
+        return names;
+    }
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL){
+        string name = entry->d_name;
+        if(name[0] == '.')
+            continue;
+        if(store.format == FILES && (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN))
+            names.push_back(name);
+        if(store.format == SEGMENT_LOG && name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0)
+            names.push_back(name.substr(0, name.size() - 4));
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+    return names;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checkpoint: one finished user per line
+
+void loadCheckpoint(){
+    ifstream file(checkpointPath);
+    string user;
+    while(getline(file, user)){
+        if(!user.empty())
+            finished.insert(user);
+    }
+}
+
+void markFinished(string user){
+    pthread_mutex_lock(&checkpointMutex);
+    ofstream file(checkpointPath, ios::app);
+    file << user << "\n";
+    file.close();
+    finished.insert(user);
+    pthread_mutex_unlock(&checkpointMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Lanes
+
+void initLane(Lane& lane){
+    pthread_mutex_init(&lane.mutex, NULL);
+    pthread_cond_init(&lane.notEmpty, NULL);
+    pthread_cond_init(&lane.notFull, NULL);
+}
+
+//blocks while the lane is full, this is the backpressure
+void push(Lane& lane, Item item){
+    pthread_mutex_lock(&lane.mutex);
+    while(lane.items.size() >= queueDepth)
+        pthread_cond_wait(&lane.notFull, &lane.mutex);
+    lane.items.push_back(move(item));
+    pthread_cond_signal(&lane.notEmpty);
+    pthread_mutex_unlock(&lane.mutex);
+}
+
+Item pop(Lane& lane){
+    pthread_mutex_lock(&lane.mutex);
+    while(lane.items.empty())
+        pthread_cond_wait(&lane.notEmpty, &lane.mutex);
+    Item item = move(lane.items.front());
+    lane.items.pop_front();
+    pthread_cond_signal(&lane.notFull);
+    pthread_mutex_unlock(&lane.mutex);
+    return item;
+}
+
+size_t laneOf(const string& user){
+    return hash<string>()(user) % laneCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Readers
+
+//message number of a "<id>.txt" file, 0 for anything else
+unsigned long messageId(const string& filename){
+    if(filename.size() < 5 || filename.compare(filename.size() - 4, 4, ".txt") != 0)
+        return 0;
+    for(size_t i = 0; i < filename.size() - 4; i++){
+        if(!isdigit((unsigned char)filename[i]))
+            return 0;
+    }
+    return strtoul(filename.c_str(), NULL, 10);
+}
+
+bool readFile(string path, string& content, time_t& date){
+    struct stat info;
+    ifstream file(path, ios::binary);
+    if(!file.is_open() || stat(path.c_str(), &info) == -1)
+        return false;
+    content.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    date = info.st_mtime;
+    return true;
+}
+
+//next number the server would give out: "# nextid" and the ids of the
+//entries in the SYNC journal, so deleted numbers are never handed out again
+unsigned long journalNextId(string user){
+    ifstream journal(source.dir + "/.sync/" + user);
+    unsigned long nextId = 1;
+    string line;
+    while(getline(journal, line)){
+        if(line.compare(0, 9, "# nextid ") == 0){
+            nextId = max(nextId, strtoul(line.c_str() + 9, NULL, 10));
+            continue;
+        }
+        if(line[0] == '#')
+            continue;
+        size_t op = line.find(' ');
+        if(op != string::npos && line.size() > op + 3)
+            nextId = max(nextId, messageId(line.substr(op + 3)) + 1);
+    }
+    return nextId;
+}
+
+//numbered messages in order, then the old <subject>.txt files numbered after
+//them and after every number the journal has seen
+bool readFiles(string user, Lane& lane){
+    string dir = source.dir + "/" + user + "/";
+    vector<pair<unsigned long, string>> files;
+    vector<string> legacy;
+    unsigned long highest = 0;
+
+    DIR* handle = opendir(dir.c_str());
+    if(handle == NULL){
+        perror(dir.c_str());
+        return false;
+    }
+    struct dirent* entry;
+    while((entry = readdir(handle)) != NULL){
+        string name = entry->d_name;
+        if(name[0] == '.' || name.size() < 5 || name.compare(name.size() - 4, 4, ".txt") != 0)
+            continue;
+        unsigned long id = messageId(name);
+        if(id == 0){
+            legacy.push_back(name);
+        }else{
+            files.push_back(make_pair(id, name));
+            highest = max(highest, id);
+        }
+    }
+    closedir(handle);
+    sort(files.begin(), files.end());
+    sort(legacy.begin(), legacy.end());
+    if(!legacy.empty())
+        highest = max(highest, journalNextId(user) - 1);
+    for(string name : legacy)
+        files.push_back(make_pair(++highest, name));
+
+    for(auto& file : files){
+        Item item = {Item::MESSAGE, user, file.first, 0, ""};
+        //deleted while we were listing, the server is still running
+        if(!readFile(dir + file.second, item.content, item.date))
+            continue;
+        push(lane, move(item));
+    }
+    return true;
+}
+
+bool readSegmentLog(string user, Lane& lane){
+    string path = source.dir + "/" + user + ".log";
+    ifstream file(path, ios::binary);
+    struct stat info;
+    if(!file.is_open() || stat(path.c_str(), &info) == -1){
+        perror(path.c_str());
+        return false;
+    }
+
+    string header;
+    while(getline(file, header)){
+        Item item = {Item::MESSAGE, user, 0, info.st_mtime, ""};
+        size_t length = 0;
+        if(sscanf(header.c_str(), "%lu %zu", &item.id, &length) != 2){
+            cerr << path << ": damaged record" << endl;
+            return false;
+        }
+        //a damaged length must not make us allocate more than the file holds
+        streamoff offset = file.tellg();
+        if(offset < 0 || length > (size_t)(info.st_size - offset)){
+            cerr << path << ": damaged record at offset " << offset << endl;
+            return false;
+        }
+        item.content.resize(length);
+        if(!file.read(&item.content[0], length) || file.get() != '\n'){
+            cerr << path << ": truncated record" << endl;
+            return false;
+        }
+        push(lane, move(item));
+    }
+    return true;
+}
+
+//only the mailboxes of its own lane, so they never interleave in the writer
+void* s_reader(void* arg){
+    long number = (long)arg;
+    for(string user : users){
+        if(laneOf(user) != (size_t)number)
+            continue;
+        Lane& lane = transformLanes[number];
+        bool complete = source.format == FILES ? readFiles(user, lane) : readSegmentLog(user, lane);
+        //a mailbox that could not be read completely is not checkpointed
+        if(complete)
+            push(lane, {Item::END_OF_MAILBOX, user, 0, 0, ""});
+        else
+            failures++;
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transformers
+
+//mboxrd: From_ line, headers, body with "From " lines quoted by one more '>'
+void toMbox(Item& item){
+    string receiver, subject, body;
+    size_t first = item.content.find('\n');
+    size_t second = first == string::npos ? string::npos : item.content.find('\n', first + 1);
+    receiver = item.content.substr(0, first);
+    if(first != string::npos)
+        subject = item.content.substr(first + 1, second == string::npos ? string::npos : second - first - 1);
+    if(second != string::npos)
+        body = item.content.substr(second + 1);
+
+    char date[64];
+    struct tm tm;
+    gmtime_r(&item.date, &tm);
+    strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", &tm);
+
+    string out = string("From twmailer ") + date + "\n";
+    out += "To: " + receiver + "\n";
+    out += "Subject: " + subject + "\n";
+    out += "X-TWMailer-Id: " + to_string(item.id) + "\n\n";
+
+    stringstream lines(body);
+    string line;
+    while(getline(lines, line)){
+        size_t quotes = line.find_first_not_of('>');
+        if(quotes != string::npos && line.compare(quotes, 5, "From ") == 0)
+            out += ">";
+        out += line + "\n";
+    }
+    out += "\n";
+    item.content = move(out);
+}
+
+void* s_transformer(void* arg){
+    long number = (long)arg;
+    while(true){
+        Item item = pop(transformLanes[number]);
+        if(item.kind == Item::MESSAGE && target.format == MBOX)
+            toMbox(item);
+        bool stop = item.kind == Item::STOP;
+        push(writeLanes[number], move(item));
+        if(stop)
+            return NULL;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writers
+// A lane writes one mailbox after the other, so only one file is open. The
+// segment and the mbox are started over whenever a mailbox is begun, which
+// drops what an interrupted run left behind; spool files are replaced.
+
+bool writeAll(int fd, const string& data){
+    size_t written = 0;
+    while(written < data.size()){
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if(n <= 0)
+            return false;
+        written += n;
+    }
+    return true;
+}
+
+bool writeMessage(const Item& item, int& fd, string& openUser){
+    if(target.format == FILES){
+        string dir = target.dir + "/" + item.user;
+        mkdir(dir.c_str(), 0777);
+        string path = dir + "/" + to_string(item.id) + ".txt";
+        string tmpPath = dir + "/.migrate.tmp";
+        int file = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(file == -1){
+            perror(tmpPath.c_str());
+            return false;
+        }
+        //on disk before the rename, or a crash could leave an empty message
+        bool written = writeAll(file, item.content) && fsync(file) == 0;
+        if(close(file) == -1)
+            written = false;
+        return written && rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+
+    if(openUser != item.user){
+        if(fd != -1)
+            close(fd);
+        string path = target.dir + "/" + item.user + (target.format == MBOX ? ".mbox" : ".log");
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(fd == -1){
+            perror(path.c_str());
+            return false;
+        }
+        openUser = item.user;
+    }
+
+    string record = item.content;
+    if(target.format == SEGMENT_LOG)
+        record = to_string(item.id) + " " + to_string(item.content.size()) + "\n" + item.content + "\n";
+    return writeAll(fd, record);
+}
+
+//the open segment or mbox and the directory entries of a mailbox reach the
+//disk before it is checkpointed
+bool syncMailbox(string user, int fd, const string& openUser){
+    if(fd != -1 && openUser == user && fsync(fd) == -1){
+        perror("fsync");
+        return false;
+    }
+    vector<string> dirs;
+    if(target.format == FILES)
+        dirs.push_back(target.dir + "/" + user);
+    dirs.push_back(target.dir);
+    for(string dir : dirs){
+        int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        //an empty mailbox never got a directory
+        if(dirFd == -1 && errno == ENOENT)
+            continue;
+        if(dirFd == -1 || fsync(dirFd) == -1){
+            perror(dir.c_str());
+            if(dirFd != -1)
+                close(dirFd);
+            return false;
+        }
+        close(dirFd);
+    }
+    return true;
+}
+
+void* s_writer(void* arg){
+    long number = (long)arg;
+    int fd = -1;
+    string openUser, failedUser;
+    unsigned long count = 0;
+
+    while(true){
+        Item item = pop(writeLanes[number]);
+        if(item.kind == Item::STOP)
+            break;
+
+        if(item.kind == Item::MESSAGE){
+            if(item.user == failedUser)
+                continue;
+            if(!writeMessage(item, fd, openUser)){
+                cerr << "Writing a message of " << item.user << " failed" << endl;
+                failedUser = item.user;
+                failures++;
+                continue;
+            }
+            count++;
+            messagesCopied++;
+            bytesCopied += item.content.size();
+            continue;
+        }
+
+        //end of a mailbox: make it durable before it is checkpointed
+        if(item.user != failedUser){
+            if(!syncMailbox(item.user, fd, openUser)){
+                failures++;
+            }else{
+                markFinished(item.user);
+                printf("Migrated %s: %lu messages\n", item.user.c_str(), count);
+            }
+        }
+        if(fd != -1){
+            close(fd);
+            fd = -1;
+        }
+        openUser.clear();
+        count = 0;
+    }
+    if(fd != -1)
+        close(fd);
+    return NULL;
+}
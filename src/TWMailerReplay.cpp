@@ -0,0 +1,393 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "SessionTrace.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMailer replay
+// Plays a trace of twmailer-server --trace against a test server. Every
+// traced session gets its own connection and sends its commands at the
+// traced times, divided by --speed (0: back to back). Redacted fields are
+// filled with as many 'x' as the original had, hashed user names become
+// "u" and seven hex digits and log in with --password, so the test server
+// should authenticate everybody (stub or fake LDAP).
+// Latency is the time until the first byte of the reply. The percentiles
+// are printed per command next to the ones of the trace; --save keeps them
+// and --baseline compares with a saved run of another build. The exit code
+// is 1 if p50 or p99 of a command got more than --threshold percent worse.
+// UPLOAD, DATA, COMMIT and WATCH depend on server state a replay doesn't
+// have and are skipped.
+
+#define BUF 1024
+#define REPLY_QUIET_MS 5        //a reply is complete after this much silence
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct TraceField {
+    int kind;
+    uint64_t length;
+    string data;                //text or 8 byte hash
+};
+
+struct TraceCommand {
+    uint64_t time;
+    uint64_t latency;
+    vector<TraceField> fields;
+};
+
+struct TraceSession {
+    uint64_t opened;
+    vector<TraceCommand> commands;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+string host, port, password = "replay";
+double speed = 1.0;
+map<uint64_t, TraceSession> sessions;
+long long replayStart;
+
+pthread_mutex_t resultMutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, vector<uint64_t>> traced, replayed;
+unsigned long skipped = 0, failedSessions = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool loadTrace(string path);
+long long nowMicros();
+void sleepUntil(long long traceTime);
+int connectServer();
+bool skipCommand(const string& command);
+string buildCommand(const TraceCommand& command);
+bool awaitReply(int sock, uint64_t& latency);
+void* s_session(void* arg);
+uint64_t percentile(vector<uint64_t>& values, double p);
+map<string, vector<uint64_t>> loadResults(string path);
+void saveResults(string path);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+    if (argc < 4) {
+        cerr << "Missing arguments!" << endl;
+        cerr << "Usage: " << argv[0] << " <trace> <host> <port> [options]" << endl;
+        cerr << "Options: --speed X --password PW --save FILE --baseline FILE --threshold PCT" << endl;
+        return EXIT_FAILURE;
+    }
+    host = argv[2];
+    port = argv[3];
+
+    string savePath, baselinePath;
+    double threshold = 20;
+    for (int i = 4; i < argc; i++)
+    {
+        string option = argv[i];
+        if (i + 1 >= argc)
+        {
+            cerr << "Invalid option: " << option << endl;
+            return EXIT_FAILURE;
+        }
+        if (option == "--speed")
+            speed = atof(argv[++i]);
+        else if (option == "--password")
+            password = argv[++i];
+        else if (option == "--save")
+            savePath = argv[++i];
+        else if (option == "--baseline")
+            baselinePath = argv[++i];
+        else if (option == "--threshold")
+            threshold = atof(argv[++i]);
+        else
+        {
+            cerr << "Invalid option: " << option << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!loadTrace(argv[1]))
+    {
+        return EXIT_FAILURE;
+    }
+    if (speed > 0)
+        printf("Replaying %zu sessions at %gx speed\n", sessions.size(), speed);
+    else
+        printf("Replaying %zu sessions back to back\n", sessions.size());
+
+    ////////////////////////////////////////////////////////////////////////////
+    // ONE THREAD PER SESSION
+    replayStart = nowMicros();
+    vector<pthread_t> threads;
+    for (auto& session : sessions)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, s_session, &session.second) != 0)
+        {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+        threads.push_back(thread);
+    }
+    for (pthread_t thread : threads)
+        pthread_join(thread, NULL);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // REPORT
+    map<string, vector<uint64_t>> baseline;
+    if (!baselinePath.empty())
+        baseline = loadResults(baselinePath);
+
+    bool regression = false;
+    printf("%-8s %7s %10s %10s %10s %10s %10s %10s\n", "command", "count",
+           "trace p50", "p99", "replay p50", "p99", baseline.empty() ? "" : "base p50", baseline.empty() ? "" : "p99");
+    for (auto& entry : replayed)
+    {
+        vector<uint64_t>& ours = entry.second;
+        printf("%-8s %7zu %8luus %8luus %8luus %8luus", entry.first.c_str(), ours.size(),
+               percentile(traced[entry.first], 0.5), percentile(traced[entry.first], 0.99),
+               percentile(ours, 0.5), percentile(ours, 0.99));
+        auto base = baseline.find(entry.first);
+        if (base != baseline.end() && !base->second.empty())
+        {
+            uint64_t p50 = percentile(base->second, 0.5), p99 = percentile(base->second, 0.99);
+            bool worse = percentile(ours, 0.5) > p50 * (1 + threshold / 100) ||
+                         percentile(ours, 0.99) > p99 * (1 + threshold / 100);
+            printf(" %8luus %8luus%s", p50, p99, worse ? "  REGRESSION" : "");
+            regression = regression || worse;
+        }
+        printf("\n");
+    }
+    printf("%lu commands skipped, %lu sessions failed\n", skipped, failedSessions);
+
+    if (!savePath.empty())
+        saveResults(savePath);
+    return regression ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Trace
+
+bool loadTrace(string path){
+    FILE* file = fopen(path.c_str(), "rb");
+    if(file == NULL){
+        perror(path.c_str());
+        return false;
+    }
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if(fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0){
+        cerr << path << " is not a session trace" << endl;
+        fclose(file);
+        return false;
+    }
+
+    //a trace cut off by a crash simply ends early
+    int type;
+    uint64_t id, time;
+    while((type = fgetc(file)) != EOF && readVarint(file, id) && readVarint(file, time)){
+        if(type == TRACE_OPEN){
+            sessions[id].opened = time;
+            continue;
+        }
+        if(type != TRACE_COMMAND)
+            continue;
+
+        TraceCommand command;
+        command.time = time;
+        uint64_t requestBytes, replyBytes;
+        int count;
+        if(!readVarint(file, command.latency) || !readVarint(file, requestBytes) ||
+           !readVarint(file, replyBytes) || (count = fgetc(file)) == EOF)
+            break;
+        bool complete = true;
+        for(int i = 0; i < count && complete; i++){
+            TraceField field;
+            field.kind = fgetc(file);
+            complete = field.kind != EOF && readVarint(file, field.length);
+            size_t payload = field.kind == FIELD_TEXT ? field.length : field.kind == FIELD_HASH ? 8 : 0;
+            field.data.resize(payload);
+            if(complete && payload > 0)
+                complete = fread(&field.data[0], 1, payload, file) == payload;
+            command.fields.push_back(field);
+        }
+        if(!complete || command.fields.empty())
+            break;
+
+        string name = command.fields[0].data;
+        traced[name].push_back(command.latency);
+        sessions[id].commands.push_back(command);
+    }
+    fclose(file);
+    return true;
+}
+
+long long nowMicros(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//wait for the replay time of a traced moment
+void sleepUntil(long long traceTime){
+    if(speed <= 0)
+        return;
+    long long due = replayStart + (long long)(traceTime / speed);
+    long long now = nowMicros();
+    if(due > now)
+        usleep(due - now);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sessions
+
+int connectServer(){
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+        return -1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock != -1 && connect(sock, result->ai_addr, result->ai_addrlen) == -1){
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+    if(sock != -1){
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return sock;
+}
+
+bool skipCommand(const string& command){
+    return command == "UPLOAD" || command == "DATA" || command == "COMMIT" || command == "WATCH";
+}
+
+//the command text with redacted fields filled in
+string buildCommand(const TraceCommand& command){
+    string text;
+    for(const TraceField& field : command.fields){
+        if(field.kind == FIELD_TEXT){
+            text += field.data;
+        }else if(field.kind == FIELD_HASH){
+            char name[16];
+            uint64_t hash;
+            memcpy(&hash, field.data.data(), sizeof(hash));
+            snprintf(name, sizeof(name), "u%07lx", (unsigned long)((hash ^ hash >> 32) & 0xfffffff));
+            text += name;
+        }else{
+            text += string(field.length, 'x');
+        }
+        text += "\n";
+    }
+    return text;
+}
+
+//time to the first reply byte, then read until the server is quiet
+bool awaitReply(int sock, uint64_t& latency){
+    long long sent = nowMicros();
+    char buffer[BUF];
+    if(recv(sock, buffer, sizeof(buffer), 0) <= 0)
+        return false;
+    latency = nowMicros() - sent;
+
+    struct pollfd fds = {sock, POLLIN, 0};
+    while(poll(&fds, 1, REPLY_QUIET_MS) > 0){
+        if(recv(sock, buffer, sizeof(buffer), 0) <= 0)
+            return false;
+    }
+    return true;
+}
+
+void* s_session(void* arg){
+    TraceSession* session = (TraceSession*)arg;
+    vector<pair<string, uint64_t>> results;
+    unsigned long skippedHere = 0;
+
+    sleepUntil(session->opened);
+    int sock = connectServer();
+    uint64_t latency;
+    //the welcome message
+    bool ok = sock != -1 && awaitReply(sock, latency);
+
+    for(const TraceCommand& command : session->commands){
+        if(!ok)
+            break;
+        string name = command.fields[0].data;
+        if(skipCommand(name)){
+            skippedHere++;
+            continue;
+        }
+        string text = buildCommand(command);
+        //the password is not in the trace
+        if(name == "LOGIN" && command.fields.size() > 2)
+            text = "LOGIN\n" + text.substr(6, text.find('\n', 6) - 6) + "\n" + password + "\n";
+
+        sleepUntil(command.time);
+        if(send(sock, text.data(), text.size(), MSG_NOSIGNAL) != (ssize_t)text.size())
+            ok = false;
+        else if(name != "QUIT")
+            ok = awaitReply(sock, latency);
+        if(ok && name != "QUIT")
+            results.push_back(make_pair(name, latency));
+    }
+    if(sock != -1)
+        close(sock);
+
+    pthread_mutex_lock(&resultMutex);
+    for(auto& result : results)
+        replayed[result.first].push_back(result.second);
+    skipped += skippedHere;
+    if(!ok)
+        failedSessions++;
+    pthread_mutex_unlock(&resultMutex);
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Results: "<command> <latency in us>" per line
+
+uint64_t percentile(vector<uint64_t>& values, double p){
+    if(values.empty())
+        return 0;
+    sort(values.begin(), values.end());
+    size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+map<string, vector<uint64_t>> loadResults(string path){
+    map<string, vector<uint64_t>> results;
+    ifstream file(path);
+    string command;
+    uint64_t latency;
+    while(file >> command >> latency)
+        results[command].push_back(latency);
+    if(results.empty())
+        cerr << "No results in " << path << endl;
+    return results;
+}
+
+void saveResults(string path){
+    ofstream file(path, ios::trunc);
+    for(auto& entry : replayed){
+        for(uint64_t latency : entry.second)
+            file << entry.first << " " << latency << "\n";
+    }
+}
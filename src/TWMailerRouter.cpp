@@ -0,0 +1,725 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include "ReadReply.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMailer router
+// Accepts clients like twmailer-server and proxies every session to the
+// backend server that owns the user's mailbox. Owners are found on a
+// consistent hash ring, so adding a backend only moves the users that now
+// hash to it. SEND is forwarded to the owner of the receiver.
+// All backend connections come from the router's address, so the backends
+// have to be started with --trusted-peer <router address>, else their
+// --max-per-ip limit turns sessions away.
+
+#define BUF 1024
+#define VIRTUAL_NODES 64        //ring points per backend
+#define UPLOAD_EXPIRY (24 * 60 * 60)    //as on the backends
+
+///////////////////////////////////////////////////////////////////////////////
+
+//a backend server and its idle, already greeted connections
+struct Backend {
+    string address;             //host:port
+    pthread_mutex_t mutex;
+    deque<int> pool;
+};
+
+//state of one proxied client connection
+struct RouterSession {
+    int socket;
+    string clientIP;
+    string user;
+    string password;
+    int loginAttempts;
+    map<Backend*, int> connections;     //logged in backend connections
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+int abortRequested = 0;
+int reloadRequested = 0;
+int create_socket = -1;
+int poolSize = 4;
+string backendsFile;
+
+//membership, replaced as a whole on reload; old backends are kept alive
+//because running sessions may still use them
+pthread_mutex_t ringMutex = PTHREAD_MUTEX_INITIALIZER;
+vector<pair<uint64_t, Backend*>> ring;
+map<string, Backend*> backends;
+
+//backend an upload was started on, so DATA and COMMIT can follow it even
+//after the client reconnected, and when it was last used
+pthread_mutex_t uploadMutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, pair<Backend*, time_t>> uploads;
+
+pthread_mutex_t blackListMutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, time_t> blackList;
+
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t hashKey(const string& key);
+int loadBackends(vector<string> addresses);
+vector<string> readBackendsFile();
+Backend* ownerOf(const string& user);
+int connectBackend(Backend* backend);
+int takeConnection(Backend* backend);
+void* s_poolRefill(void* arg);
+void* s_session(void* arg);
+int relayReply(int from, int to, const vector<string>& msg);
+int backendFor(RouterSession* session, Backend* backend);
+int relayWatch(int backend, int client);
+Backend* uploadBackend(const string& token);
+void expireUploads();
+int forwardData(int client, int backend, string command);
+void routerSignalHandler(int sig);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        cerr << "Usage: " << argv[0] << " <port> <host:port>... | --backends FILE [--pool N]" << endl;
+        return EXIT_FAILURE;
+    }
+
+    int port = atoi(argv[1]);
+    vector<string> addresses;
+    for (int i = 2; i < argc; i++)
+    {
+        string option = argv[i];
+        if (option == "--backends" && i + 1 < argc)
+            backendsFile = argv[++i];
+        else if (option == "--pool" && i + 1 < argc)
+            poolSize = atoi(argv[++i]);
+        else
+            addresses.push_back(option);
+    }
+    if (!backendsFile.empty())
+    {
+        addresses = readBackendsFile();
+    }
+    if (loadBackends(addresses) == -1)
+    {
+        cerr << "No backends configured!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // SIGNAL HANDLER
+    // SIGINT stops the router, SIGHUP re-reads the --backends file
+    if (signal(SIGINT, routerSignalHandler) == SIG_ERR ||
+        signal(SIGHUP, routerSignalHandler) == SIG_ERR)
+    {
+        perror("signal can not be registered");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // CREATE, BIND AND LISTEN
+    struct sockaddr_in address, cliaddress;
+    int reuseValue = 1;
+    if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        perror("Socket error");
+        return EXIT_FAILURE;
+    }
+    if (setsockopt(create_socket, SOL_SOCKET, SO_REUSEADDR, &reuseValue, sizeof(reuseValue)) == -1)
+    {
+        perror("set socket options - reuseAddr");
+        return EXIT_FAILURE;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(create_socket, (struct sockaddr*)&address, sizeof(address)) == -1)
+    {
+        perror("bind error");
+        return EXIT_FAILURE;
+    }
+    if (listen(create_socket, SOMAXCONN) == -1)
+    {
+        perror("listen error");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t refill;
+    pthread_create(&refill, NULL, s_poolRefill, NULL);
+
+    while (!abortRequested)
+    {
+        //wake up regularly to notice a reload request
+        struct pollfd fds = {create_socket, POLLIN, 0};
+        int ready = poll(&fds, 1, 1000);
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            if (!backendsFile.empty() && loadBackends(readBackendsFile()) == 0)
+            {
+                printf("Backends reloaded\n");
+            }
+        }
+        expireUploads();
+        if (ready <= 0)
+        {
+            if (ready == -1 && errno != EINTR)
+            {
+                perror("poll error");
+                break;
+            }
+            continue;
+        }
+
+        socklen_t addrlen = sizeof(struct sockaddr_in);
+        int new_socket = accept(create_socket, (struct sockaddr*)&cliaddress, &addrlen);
+        if (new_socket == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("accept error");
+            break;
+        }
+
+        RouterSession* session = new RouterSession();
+        session->socket = new_socket;
+        session->clientIP = inet_ntoa(cliaddress.sin_addr);
+        session->loginAttempts = 0;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, s_session, session) != 0)
+        {
+            perror("pthread_create");
+            close(new_socket);
+            delete session;
+        }
+    }
+
+    if (create_socket != -1)
+    {
+        close(create_socket);
+        create_socket = -1;
+    }
+    return EXIT_SUCCESS;
+}
+
+//FNV-1a, stable across processes so every router builds the same ring.
+//FNV barely changes the high bits for the last characters ("host:7020#1"
+//vs "host:7021#1"), so the result is mixed like in MurmurHash3
+uint64_t hashKey(const string& key){
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+vector<string> readBackendsFile(){
+    vector<string> addresses;
+    ifstream file(backendsFile);
+    string line;
+    while (getline(file, line))
+    {
+        if (!line.empty() && line[0] != '#')
+            addresses.push_back(line);
+    }
+    return addresses;
+}
+
+//rebuild the ring for the given members
+int loadBackends(vector<string> addresses){
+    if (addresses.empty())
+    {
+        return -1;
+    }
+
+    vector<pair<uint64_t, Backend*>> newRing;
+    pthread_mutex_lock(&ringMutex);
+    for (string address : addresses)
+    {
+        Backend*& backend = backends[address];
+        if (backend == nullptr)
+        {
+            backend = new Backend();
+            backend->address = address;
+            pthread_mutex_init(&backend->mutex, NULL);
+        }
+        for (int i = 0; i < VIRTUAL_NODES; i++)
+        {
+            newRing.push_back(make_pair(hashKey(address + "#" + to_string(i)), backend));
+        }
+    }
+    sort(newRing.begin(), newRing.end());
+
+    //report how many users change their owner
+    size_t moved = 0, samples = 1000;
+    if (!ring.empty())
+    {
+        for (size_t i = 0; i < samples; i++)
+        {
+            uint64_t h = hashKey("sample" + to_string(i));
+            auto before = lower_bound(ring.begin(), ring.end(), make_pair(h, (Backend*)nullptr));
+            auto after = lower_bound(newRing.begin(), newRing.end(), make_pair(h, (Backend*)nullptr));
+            if ((before == ring.end() ? ring.begin() : before)->second !=
+                (after == newRing.end() ? newRing.begin() : after)->second)
+                moved++;
+        }
+        printf("Membership changed, about %zu%% of the users move\n", moved * 100 / samples);
+    }
+    ring.swap(newRing);
+    pthread_mutex_unlock(&ringMutex);
+    return 0;
+}
+
+//first ring point at or after the user's hash owns the mailbox
+Backend* ownerOf(const string& user){
+    uint64_t h = hashKey(user);
+    pthread_mutex_lock(&ringMutex);
+    auto it = lower_bound(ring.begin(), ring.end(), make_pair(h, (Backend*)nullptr));
+    Backend* owner = (it == ring.end() ? ring.begin() : it)->second;
+    pthread_mutex_unlock(&ringMutex);
+    return owner;
+}
+
+//open a connection and consume the welcome banner; a backend that is full
+//answers with a busy line instead and is treated as unavailable
+int connectBackend(Backend* backend){
+    string host = backend->address.substr(0, backend->address.rfind(':'));
+    string port = backend->address.substr(backend->address.rfind(':') + 1);
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+    {
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, result->ai_addr, result->ai_addrlen) == -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    char buffer[BUF];
+    ssize_t size = fd == -1 ? 0 : recv(fd, buffer, BUF - 1, 0);
+    if (fd != -1 && (size < 20 || strncmp(buffer, "Welcome to TWMailer!", 20) != 0))
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+//idle pooled connection if one is still alive, otherwise a new one
+int takeConnection(Backend* backend){
+    while (true)
+    {
+        pthread_mutex_lock(&backend->mutex);
+        if (backend->pool.empty())
+        {
+            pthread_mutex_unlock(&backend->mutex);
+            return connectBackend(backend);
+        }
+        int fd = backend->pool.front();
+        backend->pool.pop_front();
+        pthread_mutex_unlock(&backend->mutex);
+
+        //an idle connection must not be readable, else the backend closed it
+        struct pollfd fds = {fd, POLLIN, 0};
+        if (poll(&fds, 1, 0) == 0)
+            return fd;
+        close(fd);
+    }
+}
+
+//keep --pool greeted connections per backend ready
+void* s_poolRefill(void*){
+    pthread_detach(pthread_self());
+    while (!abortRequested)
+    {
+        pthread_mutex_lock(&ringMutex);
+        vector<Backend*> members;
+        for (auto& point : ring)
+        {
+            if (find(members.begin(), members.end(), point.second) == members.end())
+                members.push_back(point.second);
+        }
+        pthread_mutex_unlock(&ringMutex);
+
+        for (Backend* backend : members)
+        {
+            pthread_mutex_lock(&backend->mutex);
+            int missing = poolSize - (int)backend->pool.size();
+            pthread_mutex_unlock(&backend->mutex);
+
+            for (int i = 0; i < missing; i++)
+            {
+                int fd = connectBackend(backend);
+                if (fd == -1)
+                    break;
+                pthread_mutex_lock(&backend->mutex);
+                backend->pool.push_back(fd);
+                pthread_mutex_unlock(&backend->mutex);
+            }
+        }
+        sleep(1);
+    }
+    return nullptr;
+}
+
+//forward a reply. LIST and SYNC announce their line count, READ the sizes
+//of its messages (see ReadReply.h), OK and ERR come alone
+int relayReply(int from, int to, const vector<string>& msg){
+    const string& command = msg[0];
+    bool list = command == "LIST" || command == "SYNC";
+    bool single = msg.size() > 1 && msg[1].find_first_of(",-") == string::npos;
+    char buffer[BUF];
+    string reply;
+    while (true)
+    {
+        ssize_t size = recv(from, buffer, BUF, 0);
+        if (size == -1 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            return -1;
+        if (send(to, buffer, size, MSG_NOSIGNAL) == -1)
+            return -1;
+        reply.append(buffer, size);
+
+        if (list)
+        {
+            size_t lines = count(reply.begin(), reply.end(), '\n');
+            if (lines > 0 && lines >= (size_t)atol(reply.c_str()) + 1)
+                return 0;
+            continue;
+        }
+        if (command != "READ" || reply.compare(0, 2, "OK") != 0 || readReplyComplete(reply, single))
+            return 0;
+    }
+}
+
+//WATCH: the backend answers OK (or ERR), pushes "NEW <id> <subject>\n"
+//lines and, once the client has sent a line, ends with an OK after the
+//last complete line. Everything is passed through as it comes
+int relayWatch(int backend, int client){
+    char buffer[BUF];
+    string tail;            //backend output after the last newline
+    bool opened = false;    //the opening OK was seen
+    bool stopped = false;   //the client's line was forwarded
+    while (true)
+    {
+        //a client that already stopped is not read until WATCH is over
+        struct pollfd fds[2] = {{backend, POLLIN, 0}, {stopped ? -1 : client, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t size = recv(backend, buffer, BUF, 0);
+            if (size <= 0 || send(client, buffer, size, MSG_NOSIGNAL) == -1)
+                return -1;
+            tail.append(buffer, size);
+            if (!opened && tail.size() >= 2)
+            {
+                if (tail.compare(0, 2, "OK") != 0)
+                    return 0;
+                tail.erase(0, 2);
+                opened = true;
+            }
+            size_t last = tail.rfind('\n');
+            if (opened && last != string::npos)
+                tail.erase(0, last + 1);
+            if (stopped && tail == "OK")
+                return 0;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t size = recv(client, buffer, BUF, 0);
+            if (size <= 0 || send(backend, buffer, size, MSG_NOSIGNAL) == -1)
+                return -1;
+            stopped = true;
+        }
+    }
+}
+
+Backend* uploadBackend(const string& token){
+    pthread_mutex_lock(&uploadMutex);
+    auto it = uploads.find(token);
+    Backend* backend = nullptr;
+    if (it != uploads.end())
+    {
+        backend = it->second.first;
+        it->second.second = time(nullptr);
+    }
+    pthread_mutex_unlock(&uploadMutex);
+    return backend;
+}
+
+//the backend has dropped an upload untouched for this long, so do we
+void expireUploads(){
+    time_t now = time(nullptr);
+    pthread_mutex_lock(&uploadMutex);
+    for (auto it = uploads.begin(); it != uploads.end();)
+        it = now - it->second.second > UPLOAD_EXPIRY ? uploads.erase(it) : next(it);
+    pthread_mutex_unlock(&uploadMutex);
+}
+
+//pass a DATA chunk on: command holds the DATA line and the first bytes,
+//the rest of <length> bytes is streamed through without buffering it
+int forwardData(int client, int backend, string command){
+    size_t end = command.find('\n');
+    if (end == string::npos)
+        return -1;
+    string keyword, token;
+    unsigned long offset = 0, length = 0;
+    stringstream(command.substr(0, end)) >> keyword >> token >> offset >> length;
+
+    if (send(backend, command.data(), command.size(), MSG_NOSIGNAL) == -1)
+        return -1;
+    unsigned long remaining = length - min((unsigned long)(command.size() - end - 1), length);
+
+    char chunk[65536];
+    while (remaining > 0)
+    {
+        ssize_t size = recv(client, chunk, min(remaining, (unsigned long)sizeof(chunk)), 0);
+        if (size <= 0 || send(backend, chunk, size, MSG_NOSIGNAL) == -1)
+            return -1;
+        remaining -= size;
+    }
+    return 0;
+}
+
+//connection of this session to a backend, logged in as the session's user.
+//Returns -1 if the backend is unavailable or busy and -2 if it refused the
+//login; only the latter is a failed login attempt of the client
+int backendFor(RouterSession* session, Backend* backend){
+    auto it = session->connections.find(backend);
+    if (it != session->connections.end())
+        return it->second;
+
+    int fd = takeConnection(backend);
+    if (fd == -1)
+        return -1;
+
+    string login = "LOGIN\n" + session->user + "\n" + session->password + "\n";
+    char buffer[BUF];
+    ssize_t size;
+    if (send(fd, login.c_str(), login.size(), MSG_NOSIGNAL) == -1 ||
+        (size = recv(fd, buffer, BUF - 1, 0)) <= 0)
+    {
+        close(fd);
+        return -1;
+    }
+    buffer[size] = '\0';
+    if (strncmp(buffer, "OK", 2) != 0)
+    {
+        close(fd);
+        return strncmp(buffer, "ERR Server busy", 15) == 0 ? -1 : -2;
+    }
+    session->connections[backend] = fd;
+    return fd;
+}
+
+void* s_session(void* arg){
+    RouterSession* session = (RouterSession*)arg;
+    int client = session->socket;
+    char buffer[BUF];
+    pthread_detach(pthread_self());
+
+    const char* welcome = "Welcome to TWMailer!\r\nPlease enter one of the following commands:\r\n--> LOGIN \r\n--> SEND \r\n--> LIST \r\n--> READ (Message-Number, or a list like 1,3,5-9) \r\n--> DEL (Message-Number, or a list like 1,3,5-9) \r\n--> SYNC (changes since your last SYNC) \r\n--> WATCH (new messages are pushed until you send a line) \r\n--> QUIT \r\n";
+    send(client, welcome, strlen(welcome), MSG_NOSIGNAL);
+
+    while (!abortRequested)
+    {
+        ssize_t size = recv(client, buffer, BUF - 1, 0);
+        if (size <= 0)
+            break;
+        string command(buffer, size);
+
+        vector<string> msg;
+        string line;
+        stringstream ss(command);
+        while (getline(ss, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            msg.push_back(line);
+        }
+        if (msg.empty() || msg[0] == "QUIT")
+            break;
+
+        if (session->user.empty())
+        {
+            if (msg[0] != "LOGIN" || msg.size() < 3)
+            {
+                send(client, "ERR", 3, MSG_NOSIGNAL);
+                continue;
+            }
+
+            pthread_mutex_lock(&blackListMutex);
+            auto it = blackList.find(session->clientIP);
+            bool blocked = it != blackList.end() && time(nullptr) - it->second < 60;
+            pthread_mutex_unlock(&blackListMutex);
+            if (blocked)
+            {
+                const char* reply = "Zu viele Anmeldungsversuche, in einer Minute erneut versuchen";
+                send(client, reply, strlen(reply), MSG_NOSIGNAL);
+                continue;
+            }
+
+            //the owner of the mailbox checks the credentials
+            session->user = msg[1];
+            session->password = msg[2];
+            int fd = backendFor(session, ownerOf(session->user));
+            if (fd == -1)
+            {
+                session->user.clear();
+                session->password.clear();
+                send(client, "ERR backend unavailable", 23, MSG_NOSIGNAL);
+                continue;
+            }
+            if (fd == -2)
+            {
+                session->user.clear();
+                session->password.clear();
+                if (++session->loginAttempts >= 3)
+                {
+                    pthread_mutex_lock(&blackListMutex);
+                    blackList[session->clientIP] = time(nullptr);
+                    pthread_mutex_unlock(&blackListMutex);
+                }
+                send(client, "ERR", 3, MSG_NOSIGNAL);
+                continue;
+            }
+            session->loginAttempts = 0;
+            send(client, "OK", 2, MSG_NOSIGNAL);
+            continue;
+        }
+
+        //SEND goes to the receiver's mailbox, everything else to the user's;
+        //uploads stay on the backend they were started on
+        Backend* target = nullptr;
+        string token;
+        if (msg[0].compare(0, 5, "DATA ") == 0)
+            stringstream(msg[0].substr(5)) >> token;
+        else if ((msg[0] == "COMMIT" || msg[0] == "UPLOAD") && msg.size() == 2)
+            token = msg[1];
+        if (!token.empty())
+            target = uploadBackend(token);
+        if (target == nullptr)
+            target = ownerOf((msg[0] == "SEND" || msg[0] == "UPLOAD") && msg.size() > 1 ? msg[1] : session->user);
+        int fd = backendFor(session, target);
+        if (fd < 0)
+        {
+            send(client, "ERR backend unavailable", 23, MSG_NOSIGNAL);
+            continue;
+        }
+        if (msg[0].compare(0, 5, "DATA ") == 0)
+        {
+            if (forwardData(client, fd, command) == -1 || relayReply(fd, client, {"DATA"}) == -1)
+                break;
+            continue;
+        }
+        if (msg[0] == "UPLOAD" && msg.size() > 2)
+        {
+            //remember where the new upload lives
+            char reply[BUF];
+            ssize_t size;
+            if (send(fd, command.data(), command.size(), MSG_NOSIGNAL) == -1 ||
+                (size = recv(fd, reply, BUF - 1, 0)) <= 0)
+            {
+                close(fd);
+                session->connections.erase(target);
+                send(client, "ERR backend unavailable", 23, MSG_NOSIGNAL);
+                continue;
+            }
+            string tokenReply(reply, size), status;
+            stringstream(tokenReply) >> status >> token;
+            if (status == "OK")
+            {
+                pthread_mutex_lock(&uploadMutex);
+                uploads[token] = make_pair(target, time(nullptr));
+                pthread_mutex_unlock(&uploadMutex);
+            }
+            send(client, reply, size, MSG_NOSIGNAL);
+            continue;
+        }
+        if (msg[0] == "COMMIT" && !token.empty())
+        {
+            pthread_mutex_lock(&uploadMutex);
+            uploads.erase(token);
+            pthread_mutex_unlock(&uploadMutex);
+        }
+        if (send(fd, command.data(), command.size(), MSG_NOSIGNAL) == -1 ||
+            (msg[0] == "WATCH" ? relayWatch(fd, client) : relayReply(fd, client, msg)) == -1)
+        {
+            close(fd);
+            session->connections.erase(target);
+            send(client, "ERR backend unavailable", 23, MSG_NOSIGNAL);
+        }
+    }
+
+    //backend connections are logged in as this user and cannot be pooled
+    for (auto& connection : session->connections)
+    {
+        send(connection.second, "QUIT\n", 5, MSG_NOSIGNAL);
+        close(connection.second);
+    }
+    close(client);
+    delete session;
+    return nullptr;
+}
+
+void routerSignalHandler(int sig)
+{
+    if (sig == SIGHUP)
+    {
+        reloadRequested = 1;
+    }
+    else if (sig == SIGINT)
+    {
+        printf("abort Requested... ");
+        abortRequested = 1;
+    }
+}
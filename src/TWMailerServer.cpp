@@ -16,8 +16,26 @@
 #include <experimental/filesystem>
 #include <fstream> 
 #include <dirent.h>
+#include <fcntl.h>
 #include <iterator>
 #include <map>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <set>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include "SpoolScanner.h"
+#include "SessionTrace.h"
+#include "Probes.h"
 
 using namespace std;
 
@@ -27,40 +45,367 @@ using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+//state of one client connection, owned by its thread
+struct Session {
+    int socket;
+    in_addr_t address;
+    string clientIP;
+    string authenticatedUser;
+    int loginAttempts;
+    bool resumed;               //handed over by a previous server process
+    bool watching;              //parked in WATCH
+    uint64_t traceId;           //session number in --trace files and --timing dumps
+    string pending;             //received after a DATA chunk, the next command
+};
+
+//modification sequence of a mailbox and where its journal begins
+struct MailboxJournal {
+    unsigned long modseq;       //last change
+    unsigned long floor;        //removals up to here were compacted away
+    unsigned long entries;      //lines in the journal file
+    unsigned long nextId;       //number of the next message
+    unsigned long compactAt;    //entries that trigger the next compaction
+    unsigned long epoch;        //drawn when the journal is started, part of every token
+    ino_t inode;                //journal file the state was read from
+    off_t length;               //bytes of it taken in
+};
+
+#define JOURNAL_COMPACT 10000
+
+//a resumable SEND streamed to <spool>/.uploads/<token>
+struct Upload {
+    string user;                //who started it, only they may continue
+    string receiver;
+    string subject;
+    unsigned long size;         //announced body size
+    unsigned long headerSize;   //receiver and subject lines before the body
+};
+
+#define UPLOAD_CHUNK 65536
+#define UPLOAD_EXPIRY (24 * 60 * 60)
+
+//a session parked in WATCH, see watchMailbox
+struct Watcher {
+    int event;                  //eventfd, signalled when pending is filled
+    vector<string> pending;     //notifications, guarded by watchMutex
+};
+
+//where the time of one command went, all times in microseconds
+struct CommandTiming {
+    long long start;            //CLOCK_MONOTONIC, when it was received
+    long long total;
+    long long queue;            //waiting for a worker slot
+    long long auth;             //LDAP
+    long long spool;            //message files, directories and journals
+    long long reply;            //sending the answer
+    uint64_t session;
+    char command[8];
+    char user[32];
+    char clientIP[16];
+};
+
+//the last commands of one session thread; only the owner writes, claimed
+//before and head after each entry, so the dump needs no lock
+struct TimingRing {
+    atomic<unsigned long> head; //commands recorded so far
+    atomic<unsigned long> claimed;  //head + 1 while an entry is written
+    atomic<bool> owned;         //by a running thread
+    CommandTiming* entries;     //timingSize of them
+};
+
+//one part of the message cache, most recently used entry first
+struct CacheShard {
+    pthread_mutex_t mutex;
+    list<pair<string, string>> lru;
+    unordered_map<string, list<pair<string, string>>::iterator> index;
+    size_t bytes;
+    unsigned long generation;   //counts invalidations, see cacheInsert
+};
+
+#define CACHE_SHARDS 16
+
+//one SEND or DEL as streamed from the primary to its followers
+struct ChangeRecord {
+    unsigned long seq;
+    long long timestamp;        //milliseconds since the epoch on the primary
+    bool remove;
+    string user;
+    string filename;
+    string content;
+};
+
+//a connected follower as seen by the primary
+struct Follower {
+    int socket;
+    string address;
+    unsigned long ackedSeq;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
 int abortRequested = 0;
 int create_socket = -1;
 int new_socket = -1;
 string dirname;
 
  map<string, time_t> blackList;
+pthread_rwlock_t blackListLock = PTHREAD_RWLOCK_INITIALIZER;
+
+//LDAP unless replaced, e.g. by the benchmarks
+int (*authenticator)(vector<string> msg) = nullptr;
+
+//admission control limits (see parseOptions)
+int maxConnections = 256;       //concurrent connections in total
+int maxConnectionsPerIP = 16;   //concurrent connections per client address
+int maxWorkers = 32;            //commands executing at the same time
+int maxQueueDepth = 64;         //commands waiting for a free worker slot
+set<in_addr_t> trustedPeers;    //e.g. routers, not held to the per address limit
+
+//connection counters, only touched by the accept loop and exiting sessions
+pthread_mutex_t admissionMutex = PTHREAD_MUTEX_INITIALIZER;
+int activeConnections = 0;
+map<in_addr_t, int> connectionsPerIP;
+
+//worker slots, authenticated sessions are served before LOGIN attempts
+pthread_mutex_t workMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workAvailable = PTHREAD_COND_INITIALIZER;
+int busyWorkers = 0;
+int busyAnonymousWorkers = 0;
+int waitingAuthenticated = 0;
+int waitingAnonymous = 0;
+
+const char busyReply[] = "ERR Server busy, retry later\n";
+
+//READ cache, see initMessageCache
+size_t cacheBudget = 64 << 20;
+
+//check the whole spool in parallel before accepting clients; repairs only
+//when no predecessor is still serving it
+bool fsckAtStartup = false;
+CacheShard messageCache[CACHE_SHARDS];
+atomic<unsigned long> cacheHits(0), cacheMisses(0), cacheEvictions(0);
+
+//replication, see openReplicationSocket (primary) and s_follow (follower)
+int replicationPort = 0;
+in_addr_t replicationBind = htonl(INADDR_LOOPBACK); //--replication-bind
+string replicationSecret;       //first line of --replication-secret, sent by followers
+size_t replicationLogSize = 100000;
+string followAddress;           //host:port of the primary, empty if primary
+pthread_mutex_t replicationMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t replicationChanged = PTHREAD_COND_INITIALIZER;
+deque<ChangeRecord> changeLog;
+unsigned long replicationSeq = 0;
+long long replicationEpoch = 0; //identifies the primary's change log
+vector<Follower*> followers;
+atomic<unsigned long> appliedSeq(0), primaryHeadSeq(0);
+atomic<long long> applyDelay(0);
+
+//modification journal of every mailbox, see recordChange
+pthread_mutex_t syncMutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, MailboxJournal> journals;
+
+//subject of every message number seen, per user; a number is never reused,
+//so an entry stays valid until the message is deleted
+pthread_mutex_t subjectMutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, map<unsigned long, string>> subjects;
+
+//WATCH subscribers per user; mailboxes with subscribers are also watched
+//with inotify to see deliveries of other processes sharing the spool
+pthread_mutex_t watchMutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, vector<Watcher*>> watchers;
+map<string, int> mailboxWatches;        //user -> inotify watch descriptor
+map<int, string> watchedMailboxes;      //inotify watch descriptor -> user
+map<string, time_t> recentDeliveries;   //"<user>/<file>", to drop inotify echoes
+int inotifyFd = -1;
+
+//zero-downtime restart: a new server connects to the old one on this unix
+//socket and receives the listening socket (and idle sessions) via SCM_RIGHTS
+string upgradeSocketPath;
+bool handoffSessions = false;
+int upgrade_socket = -1;
+int handoffPipe[2] = {-1, -1};  //readable once idle sessions should leave
+int handoffRequested = 0;
+int takeoverComplete = 0;       //the main loop opens the upgrade socket then
+pthread_mutex_t handoffMutex = PTHREAD_MUTEX_INITIALIZER;
+vector<Session*> handoffQueue;
+
+//local delivery: processes on this host hand message bodies over as file
+//descriptors on a unix socket and are trusted by their uid instead of LDAP
+string localSocketPath;
+set<uid_t> localUids;           //besides root and our own uid
+int local_socket = -1;
+atomic<unsigned long> tempFiles(0);  //names temporary message files
+
+//session capture for twmailer-replay, see TRACE
+string tracePath;
+FILE* traceFile = nullptr;
+pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+long long traceEpoch = 0;
+long long traceFlushed = 0;
+uint64_t traceKey = 0;          //hash key, never written to the trace
+atomic<uint64_t> traceSessions(0);
+thread_local size_t replyBytes = 0;
+
+//per-command timing breakdown (--timing N), see TIMING
+size_t timingSize = 0;          //commands kept per thread, 0 = off
+int timingDumpRequested = 0;    //set by SIGUSR1
+pthread_mutex_t timingMutex = PTHREAD_MUTEX_INITIALIZER;
+vector<TimingRing*> timingRings;
+thread_local CommandTiming currentTiming;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+int parseOptions(int argc, char** argv);
+bool admitConnection(in_addr_t address);
+void releaseConnection(in_addr_t address);
+bool acquireWorkSlot(bool authenticated);
+void releaseWorkSlot(bool authenticated);
+int openUpgradeSocket();
+int takeOverFromPredecessor();
+void* s_takeover(void* arg);
+int waitForConnection();
+void handOver(int channel);
+int sendDescriptor(int channel, int fd, string text);
+int receiveDescriptor(int channel, int* fd, string& text);
+void queueHandoff(Session* session);
+int initSpoolWatcher();
+void* s_spoolWatcher(void* arg);
+void registerWatcher(string user, Watcher* watcher);
+void unregisterWatcher(string user, Watcher* watcher);
+void notifyWatchers(string user, string filename);
+int watchMailbox(Session* session, bool resumed);
+void sendMessage(int* socket, const char* msg);
 void* clientCommunication(void* data);
+vector<string> parseCommand(const char* buffer);
+void loginUser(vector<string> msg, Session* session);
 void signalHandler(int sig);
 void* s_threading(void* arg);
+string mailboxPath(string user);
 int saveMessage(vector<string> msg);
-vector<string> listFiles(char* directory);
+vector<string> listFiles(const char* directory);
+unsigned long messageId(const string& filename);
+vector<unsigned long> listMessageIds(string user);
+bool parseIdSet(string spec, vector<pair<unsigned long, unsigned long>>& ranges);
+vector<unsigned long> selectMessageIds(string user, const vector<pair<unsigned long, unsigned long>>& ranges);
+string messageSubject(string user, string filename);
+string contentSubject(const string& content);
+void rememberSubject(string user, string filename, string subject);
 void listMessages(int* current_socket, string authenticatedUser);
+bool loadMessage(string user, string filename, string& content);
 void readMessage(vector<string> msg, int* socket, string authenticatedUser);
+bool deleteMessage(string user, string filename);
 void delMessage(vector<string> msg, int* socket, string authenticatedUser);
+string journalPath(string user);
+MailboxJournal& loadJournal(string user);
+int lockJournal(string user, MailboxJournal& journal);
+unsigned long allocateMessageId(string user);
+bool linkMessageFile(string user, string from, unsigned long& id);
+void migrateSpool();
+unsigned long recordChange(string user, string filename, bool removed);
+void compactJournal(string user, MailboxJournal& journal);
+void syncMailbox(vector<string> msg, int* socket, string authenticatedUser);
+string uploadPath(string token);
+bool loadUpload(string token, Upload& upload);
+unsigned long uploadOffset(string token, const Upload& upload);
+void expireUploads();
+void startUpload(vector<string> msg, int* socket, string authenticatedUser);
+int receiveUploadData(int* socket, char* buffer, int size, string authenticatedUser, string& leftover, bool admitted);
+void commitUpload(vector<string> msg, int* socket, string authenticatedUser);
+int openLocalSocket();
+void* s_localListener(void* arg);
+void* s_localDelivery(void* arg);
+bool copyBody(int body, int out);
+bool deliverLocal(string receiver, string subject, int body, unsigned long& id);
+long long nowMicros();
+int openTrace();
+void writeTrace(const string& record);
+void traceSession(Session* session, TraceRecordType type);
+void traceCommand(Session* session, const vector<string>& msg, long long start, size_t requestBytes);
+void closeTrace();
+void finishCommand(Session* session, const vector<string>& msg, long long start, size_t requestBytes);
+TimingRing* threadTimingRing();
+void recordTiming(Session* session, const vector<string>& msg, long long start);
+void dumpTimings();
+void initMessageCache();
+bool cacheLookup(string user, string filename, string& content, unsigned long* generation = nullptr);
+void cacheInsert(string user, string filename, const string& content, unsigned long generation);
+void cacheInvalidate(string user, string filename);
+void printCacheStats();
+long long nowMillis();
+string formatChange(const ChangeRecord& record);
+int sendAll(int socket, const string& data);
+int recvLine(int socket, string& pending, string& line);
+int recvExact(int socket, string& pending, size_t size, string& data);
+void logChange(bool remove, string user, string filename, const string& content);
+int openReplicationSocket();
+void* s_replicationListener(void* arg);
+void* s_replicationFeed(void* arg);
+int sendSnapshot(int socket, unsigned long* startSeq);
+void* s_follow(void* arg);
+int followPrimary(int socket, string& statePath);
+int applyChange(bool remove, string user, string filename, const string& content);
+void printReplicationStats();
 int authenticateUser(vector<string> msg);
 int ldapAuthentication(const char ldapBindPassword[], const char ldapUser[]);
 void blackListUser(string clientIP);
 bool checkBlacklisted(string clientIP);
 
+//adds the time until the end of its scope to one phase of the current
+//command, a single branch while --timing is off
+struct PhaseTimer {
+    long long* phase;
+    long long start;
+    PhaseTimer(long long& total) : phase(timingSize != 0 ? &total : nullptr), start(phase != nullptr ? nowMicros() : 0) {}
+    ~PhaseTimer(){
+        if (phase != nullptr)
+            *phase += nowMicros() - start;
+    }
+};
+
+//gives a thread's timing ring back when the thread ends
+struct RingHolder {
+    TimingRing* ring = nullptr;
+    ~RingHolder(){
+        if (ring != nullptr)
+            ring->owned.store(false, memory_order_release);
+    }
+};
+thread_local RingHolder ringHolder;
+
 ///////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char** argv)
 {
-    if (argc < 2) {
+    if (argc < 3) {
         cerr << "Missing arguments!" << endl;
+        cerr << "Usage: " << argv[0] << " <port> <mail-spool-directoryname> [options]" << endl;
         return EXIT_FAILURE;
     }
 
     int port = atoi(argv[1]);
     dirname = argv[2];
 
+    if (parseOptions(argc, argv) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    initMessageCache();
+    if (initSpoolWatcher() == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (replicationPort != 0 && !followAddress.empty())
+    {
+        cerr << "A follower cannot accept followers itself" << endl;
+        return EXIT_FAILURE;
+    }
+    if ((replicationPort != 0 || !followAddress.empty()) && replicationSecret.empty())
+    {
+        cerr << "Replication needs --replication-secret FILE" << endl;
+        return EXIT_FAILURE;
+    }
+
     socklen_t addrlen;
     struct sockaddr_in address, cliaddress;
     int reuseValue = 1;
@@ -75,425 +420,3244 @@ int main(int argc, char** argv)
         return EXIT_FAILURE;
     }
 
+    // a client vanishing while we answer must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 dumps the command timings (--timing)
+    if (signal(SIGUSR1, signalHandler) == SIG_ERR)
+    {
+        perror("signal can not be registered");
+        return EXIT_FAILURE;
+    }
+
     ////////////////////////////////////////////////////////////////////////////
-   // CREATE A SOCKET
-   // https://man7.org/linux/man-pages/man2/socket.2.html
-   // https://man7.org/linux/man-pages/man7/ip.7.html
-   // https://man7.org/linux/man-pages/man7/tcp.7.html
-   // IPv4, TCP (connection oriented), IP (same as client)
-    if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-    {
-        perror("Socket error"); // errno set by socket()
+    // TAKE OVER FROM A RUNNING SERVER
+    // with --upgrade-socket the listening socket is inherited from the old
+    // process if one is running, so no connection is refused during a restart
+    int takenOver = 0;
+    if (!upgradeSocketPath.empty() && (takenOver = takeOverFromPredecessor()) == -1)
+    {
         return EXIT_FAILURE;
     }
 
+    //only now is it known whether a predecessor still serves the spool
+    if (fsckAtStartup)
+    {
+        //a follower only reports, its primary owns the contents; so does a
+        //successor, as the old process may be writing messages and journals
+        ScanOptions options = {dirname, 0, followAddress.empty() && !takenOver, true};
+        ScanResult result;
+        if (scanSpool(options, result) == -1)
+        {
+            return EXIT_FAILURE;
+        }
+        printScanResult(result);
+        if (takenOver)
+        {
+            printf("Predecessor still running, --fsck only reported\n");
+        }
+    }
+    if (followAddress.empty())
+    {
+        migrateSpool();
+        expireUploads();
+    }
+
+    if (!takenOver)
+    {
+        ////////////////////////////////////////////////////////////////////////////
+       // CREATE A SOCKET
+       // https://man7.org/linux/man-pages/man2/socket.2.html
+       // https://man7.org/linux/man-pages/man7/ip.7.html
+       // https://man7.org/linux/man-pages/man7/tcp.7.html
+       // IPv4, TCP (connection oriented), IP (same as client)
+        if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        {
+            perror("Socket error"); // errno set by socket()
+            return EXIT_FAILURE;
+        }
+
+        ////////////////////////////////////////////////////////////////////////////
+        // SET SOCKET OPTIONS
+        // https://man7.org/linux/man-pages/man2/setsockopt.2.html
+        // https://man7.org/linux/man-pages/man7/socket.7.html
+        // socket, level, optname, optvalue, optlen
+        if (setsockopt(create_socket,
+            SOL_SOCKET,
+            SO_REUSEADDR,
+            &reuseValue,
+            sizeof(reuseValue)) == -1)
+        {
+            perror("set socket options - reuseAddr");
+            return EXIT_FAILURE;
+        }
+
+        if (setsockopt(create_socket,
+            SOL_SOCKET,
+            SO_REUSEPORT,
+            &reuseValue,
+            sizeof(reuseValue)) == -1)
+        {
+            perror("set socket options - reusePort");
+            return EXIT_FAILURE;
+        }
+
+
+        ////////////////////////////////////////////////////////////////////////////
+        // INIT ADDRESS
+        // Attention: network byte order => big endian
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+
+        ////////////////////////////////////////////////////////////////////////////
+        // ASSIGN AN ADDRESS WITH PORT TO SOCKET
+        if (bind(create_socket, (struct sockaddr*)&address, sizeof(address)) == -1)
+        {
+            perror("bind error");
+            return EXIT_FAILURE;
+        }
+
+        ////////////////////////////////////////////////////////////////////////////
+        // ALLOW CONNECTION ESTABLISHING
+        // Socket, Backlog (= count of waiting connections allowed)
+        if (listen(create_socket, SOMAXCONN) == -1)
+        {
+            perror("listen error");
+            return EXIT_FAILURE;
+        }
+    }
+
     ////////////////////////////////////////////////////////////////////////////
-    // SET SOCKET OPTIONS
-    // https://man7.org/linux/man-pages/man2/setsockopt.2.html
-    // https://man7.org/linux/man-pages/man7/socket.7.html
-    // socket, level, optname, optvalue, optlen
-    if (setsockopt(create_socket,
-        SOL_SOCKET,
-        SO_REUSEADDR,
-        &reuseValue,
-        sizeof(reuseValue)) == -1)
-    {
-        perror("set socket options - reuseAddr");
+    // REPLICATION
+    // the primary streams its changes to followers, a follower applies them
+    // and only serves LIST and READ
+    if (replicationPort != 0 && openReplicationSocket() == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    if (!followAddress.empty())
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, s_follow, NULL) != 0)
+        {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!localSocketPath.empty() && openLocalSocket() == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    if (!tracePath.empty() && openTrace() == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    //a successor opens the upgrade socket once the handover is complete
+    if (!upgradeSocketPath.empty() && !takenOver && openUpgradeSocket() == -1)
+    {
         return EXIT_FAILURE;
     }
 
-    if (setsockopt(create_socket,
-        SOL_SOCKET,
-        SO_REUSEPORT,
-        &reuseValue,
-        sizeof(reuseValue)) == -1)
-    {
-        perror("set socket options - reusePort");
-        return EXIT_FAILURE;
+    while (!abortRequested)
+    {
+        /////////////////////////////////////////////////////////////////////////
+        // ignore errors here... because only information message
+        // https://linux.die.net/man/3/printf
+        printf("Waiting for connections...\n");
+
+        int ready = waitForConnection();
+        if (ready == -1)
+        {
+            break;
+        }
+        if (ready == 1)
+        {
+            /////////////////////////////////////////////////////////////////////
+            // A NEW SERVER PROCESS TAKES OVER
+            // stop accepting, pass everything on and wait for running commands
+            int channel = accept(upgrade_socket, NULL, NULL);
+            if (channel == -1)
+            {
+                perror("accept upgrade connection");
+                continue;
+            }
+            handOver(channel);
+            break;
+        }
+
+        /////////////////////////////////////////////////////////////////////////
+        // ACCEPTS CONNECTION SETUP
+        // might have an accept-error on ctrl+c
+        addrlen = sizeof(struct sockaddr_in);
+        if ((new_socket = accept(create_socket,
+            (struct sockaddr*)&cliaddress,
+            &addrlen)) == -1)
+        {
+            if (abortRequested)
+            {
+                perror("accept error after aborted");
+            }
+            else
+            {
+                perror("accept error");
+            }
+            break;
+        }
+
+        //shed load before allocating anything for the connection
+        if (!admitConnection(cliaddress.sin_addr.s_addr))
+        {
+            send(new_socket, busyReply, strlen(busyReply), MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(new_socket);
+            new_socket = -1;
+            continue;
+        }
+
+        Session* session = new Session();
+        session->socket = new_socket;
+        session->address = cliaddress.sin_addr.s_addr;
+        session->loginAttempts = 0;
+
+        //create thread
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, s_threading, session) != 0)
+        {
+            perror("pthread_create");
+            close(session->socket);
+            releaseConnection(session->address);
+            delete session;
+        }
+    }
+
+    // frees the descriptor
+    if (create_socket != -1)
+    {
+        if (shutdown(create_socket, SHUT_RDWR) == -1)
+        {
+            perror("shutdown create_socket");
+        }
+        if (close(create_socket) == -1)
+        {
+            perror("close create_socket");
+        }
+        create_socket = -1;
+    }
+
+    if (upgrade_socket != -1)
+    {
+        close(upgrade_socket);
+        unlink(upgradeSocketPath.c_str());
+        upgrade_socket = -1;
+    }
+
+    if (local_socket != -1)
+    {
+        shutdown(local_socket, SHUT_RDWR);
+        close(local_socket);
+        unlink(localSocketPath.c_str());
+        local_socket = -1;
+    }
+
+    printCacheStats();
+    printReplicationStats();
+    closeTrace();
+
+    return EXIT_SUCCESS;
+}
+
+//parse the optional admission control settings following port and directory
+int parseOptions(int argc, char** argv){
+    for (int i = 3; i < argc; i++)
+    {
+        string option = argv[i];
+        int* target = nullptr;
+
+        if (option == "--handoff-sessions")
+        {
+            handoffSessions = true;
+            continue;
+        }
+        if (option == "--fsck")
+        {
+            fsckAtStartup = true;
+            continue;
+        }
+        if (option == "--replication-port" && i + 1 < argc)
+        {
+            replicationPort = atoi(argv[++i]);
+            continue;
+        }
+        if (option == "--replication-bind" && i + 1 < argc)
+        {
+            struct in_addr bindAddress;
+            if (inet_pton(AF_INET, argv[i + 1], &bindAddress) != 1)
+            {
+                cerr << "Invalid address: " << argv[i + 1] << endl;
+                return -1;
+            }
+            replicationBind = bindAddress.s_addr;
+            i++;
+            continue;
+        }
+        if (option == "--replication-secret" && i + 1 < argc)
+        {
+            //read from a file so it does not show up in ps
+            ifstream secretFile(argv[++i]);
+            getline(secretFile, replicationSecret);
+            if (replicationSecret.empty())
+            {
+                cerr << "Empty or unreadable secret file: " << argv[i] << endl;
+                return -1;
+            }
+            continue;
+        }
+        if (option == "--replication-log" && i + 1 < argc)
+        {
+            replicationLogSize = (size_t)atol(argv[++i]);
+            continue;
+        }
+        if (option == "--follow" && i + 1 < argc)
+        {
+            followAddress = argv[++i];
+            continue;
+        }
+        if (option == "--cache-mb" && i + 1 < argc)
+        {
+            cacheBudget = (size_t)atol(argv[++i]) << 20;
+            continue;
+        }
+        if (option == "--local-socket" && i + 1 < argc)
+        {
+            localSocketPath = argv[++i];
+            continue;
+        }
+        if (option == "--local-uid" && i + 1 < argc)
+        {
+            localUids.insert((uid_t)atoi(argv[++i]));
+            continue;
+        }
+        if (option == "--trace" && i + 1 < argc)
+        {
+            tracePath = argv[++i];
+            continue;
+        }
+        if (option == "--timing" && i + 1 < argc && atol(argv[i + 1]) > 0)
+        {
+            timingSize = (size_t)atol(argv[++i]);
+            continue;
+        }
+        if (option == "--trusted-peer" && i + 1 < argc)
+        {
+            //a router proxies all its clients from one address
+            struct in_addr peer;
+            if (inet_pton(AF_INET, argv[i + 1], &peer) != 1)
+            {
+                cerr << "Invalid address: " << argv[i + 1] << endl;
+                return -1;
+            }
+            trustedPeers.insert(peer.s_addr);
+            i++;
+            continue;
+        }
+        if (option == "--upgrade-socket" && i + 1 < argc)
+        {
+            upgradeSocketPath = argv[++i];
+            continue;
+        }
+
+        if (option == "--max-connections")
+            target = &maxConnections;
+        else if (option == "--max-per-ip")
+            target = &maxConnectionsPerIP;
+        else if (option == "--workers")
+            target = &maxWorkers;
+        else if (option == "--queue-depth")
+            target = &maxQueueDepth;
+
+        if (target == nullptr || i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+        {
+            cerr << "Invalid option: " << option << endl;
+            cerr << "Options: --max-connections N --max-per-ip N [--trusted-peer ADDR]... --workers N --queue-depth N" << endl;
+            cerr << "         --cache-mb N --upgrade-socket PATH [--handoff-sessions]" << endl;
+            cerr << "         --replication-port N [--replication-bind ADDR] [--replication-log N] | --follow HOST:PORT" << endl;
+            cerr << "         --replication-secret FILE (required by both sides of replication)" << endl;
+            cerr << "         --local-socket PATH [--local-uid UID]... --fsck --trace FILE --timing N" << endl;
+            return -1;
+        }
+        *target = atoi(argv[++i]);
+    }
+    return 0;
+}
+
+//check global and per-address limits and count the connection if admitted
+bool admitConnection(in_addr_t address){
+    bool admitted = false;
+
+    pthread_mutex_lock(&admissionMutex);
+    auto it = connectionsPerIP.find(address);
+    int fromAddress = it == connectionsPerIP.end() ? 0 : it->second;
+    bool trusted = trustedPeers.count(address) != 0;
+    if (activeConnections < maxConnections && (fromAddress < maxConnectionsPerIP || trusted))
+    {
+        activeConnections++;
+        connectionsPerIP[address] = fromAddress + 1;
+        admitted = true;
+    }
+    pthread_mutex_unlock(&admissionMutex);
+
+    if (!admitted)
+    {
+        printf("Connection limit reached, rejecting client\n");
+    }
+    return admitted;
+}
+
+void releaseConnection(in_addr_t address){
+    pthread_mutex_lock(&admissionMutex);
+    activeConnections--;
+    auto it = connectionsPerIP.find(address);
+    if (it != connectionsPerIP.end() && --it->second <= 0)
+    {
+        connectionsPerIP.erase(it);
+    }
+    pthread_mutex_unlock(&admissionMutex);
+}
+
+//wait for a worker slot; returns false if the request has to be shed.
+//a quarter of the slots and half of the queue are kept for logged in users,
+//so a LOGIN storm (slow LDAP binds) cannot starve existing sessions
+bool acquireWorkSlot(bool authenticated){
+    PhaseTimer timer(currentTiming.queue);
+    //both at least 1, or small settings would shed every LOGIN
+    int anonymousWorkers = max(1, maxWorkers - maxWorkers / 4);
+    int anonymousQueueDepth = max(1, maxQueueDepth / 2);
+
+    pthread_mutex_lock(&workMutex);
+    if (authenticated)
+    {
+        //only requests that would have to wait count against the queue
+        if (busyWorkers >= maxWorkers && waitingAuthenticated + waitingAnonymous >= maxQueueDepth)
+        {
+            pthread_mutex_unlock(&workMutex);
+            return false;
+        }
+        waitingAuthenticated++;
+        while (busyWorkers >= maxWorkers)
+        {
+            pthread_cond_wait(&workAvailable, &workMutex);
+        }
+        waitingAuthenticated--;
+    }
+    else
+    {
+        bool mustWait = busyWorkers >= maxWorkers || waitingAuthenticated > 0 ||
+                        busyAnonymousWorkers >= anonymousWorkers;
+        if (mustWait && waitingAuthenticated + waitingAnonymous >= anonymousQueueDepth)
+        {
+            pthread_mutex_unlock(&workMutex);
+            return false;
+        }
+        waitingAnonymous++;
+        while (busyWorkers >= maxWorkers || waitingAuthenticated > 0 ||
+               busyAnonymousWorkers >= anonymousWorkers)
+        {
+            pthread_cond_wait(&workAvailable, &workMutex);
+        }
+        waitingAnonymous--;
+        busyAnonymousWorkers++;
+    }
+    busyWorkers++;
+    pthread_mutex_unlock(&workMutex);
+    return true;
+}
+
+void releaseWorkSlot(bool authenticated){
+    pthread_mutex_lock(&workMutex);
+    busyWorkers--;
+    if (!authenticated)
+    {
+        busyAnonymousWorkers--;
+    }
+    pthread_cond_broadcast(&workAvailable);
+    pthread_mutex_unlock(&workMutex);
+}
+
+//listen for a successor process on the upgrade socket
+int openUpgradeSocket(){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, upgradeSocketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    unlink(address.sun_path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock == -1 ||
+        bind(sock, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(sock, 1) == -1)
+    {
+        perror("upgrade socket");
+        if (sock != -1)
+            close(sock);
+        return -1;
+    }
+
+    //idle sessions leave through this pipe, handed over or closed
+    if (handoffPipe[0] == -1 && pipe(handoffPipe) == -1)
+    {
+        perror("handoff pipe");
+        close(sock);
+        return -1;
+    }
+    upgrade_socket = sock;
+    return 0;
+}
+
+//connect to a running server; returns 1 if its listening socket was taken
+//over, 0 if there is no predecessor and -1 on error
+int takeOverFromPredecessor(){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, upgradeSocketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    int channel = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (channel == -1)
+    {
+        perror("upgrade socket");
+        return -1;
+    }
+    if (connect(channel, (struct sockaddr*)&address, sizeof(address)) == -1)
+    {
+        close(channel);
+        return 0;
+    }
+
+    string text;
+    if (receiveDescriptor(channel, &create_socket, text) == -1 || text != "LISTEN")
+    {
+        cerr << "Handover from previous server failed" << endl;
+        close(channel);
+        return -1;
+    }
+    printf("Took over listening socket from previous server\n");
+
+    //sessions arrive while the old process drains, so keep accepting meanwhile
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, s_takeover, (void*)(intptr_t)channel) != 0)
+    {
+        perror("pthread_create");
+        close(channel);
+        return -1;
+    }
+    return 1;
+}
+
+//receive idle sessions from the old process until it is done
+void* s_takeover(void* arg){
+    int channel = (int)(intptr_t)arg;
+    pthread_detach(pthread_self());
+
+    int fd;
+    string text;
+    while (receiveDescriptor(channel, &fd, text) == 0 && text != "DONE")
+    {
+        //SESSION\n<user>\n<login attempts>\n<watching>
+        vector<string> fields;
+        string line;
+        stringstream ss(text);
+        while (getline(ss, line))
+        {
+            fields.push_back(line);
+        }
+        if (fd == -1 || fields.size() < 3 || fields[0] != "SESSION")
+        {
+            if (fd != -1)
+                close(fd);
+            continue;
+        }
+
+        Session* session = new Session();
+        session->socket = fd;
+        session->authenticatedUser = fields[1];
+        session->loginAttempts = atoi(fields[2].c_str());
+        session->resumed = true;
+        session->watching = fields.size() > 3 && fields[3] == "1";
+
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        session->address = getpeername(fd, (struct sockaddr*)&peer, &len) == 0 ? peer.sin_addr.s_addr : 0;
+
+        //already admitted by the old process, so only count it
+        pthread_mutex_lock(&admissionMutex);
+        activeConnections++;
+        connectionsPerIP[session->address]++;
+        pthread_mutex_unlock(&admissionMutex);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, s_threading, session) != 0)
+        {
+            perror("pthread_create");
+            close(fd);
+            releaseConnection(session->address);
+            delete session;
+        }
+    }
+    close(channel);
+    printf("Handover complete\n");
+
+    //the poll loop owns upgrade_socket, let it open the socket
+    takeoverComplete = 1;
+    return nullptr;
+}
+
+//block until a client (0) or a successor process (1) connects, -1 on abort
+int waitForConnection(){
+    while (!abortRequested)
+    {
+        //SIGUSR1 only sets the flag, the timeout below bounds the delay
+        if (timingDumpRequested)
+        {
+            timingDumpRequested = 0;
+            dumpTimings();
+        }
+
+        //our predecessor has drained, we can be replaced in turn
+        if (takeoverComplete)
+        {
+            takeoverComplete = 0;
+            if (openUpgradeSocket() == -1)
+            {
+                cerr << "No upgrade socket, this process can only be restarted by stopping it" << endl;
+            }
+        }
+
+        /////////////////////////////////////////////////////////////////////////
+        // https://man7.org/linux/man-pages/man2/poll.2.html
+        // negative descriptors are ignored, the upgrade socket may only be
+        // opened once the takeover thread is done, hence the timeout
+        struct pollfd fds[2] = {{create_socket, POLLIN, 0}, {upgrade_socket, POLLIN, 0}};
+        int ready = poll(fds, 2, 1000);
+        if (ready == -1 && errno != EINTR)
+        {
+            perror("poll error");
+            return -1;
+        }
+        if (ready <= 0)
+            continue;
+        if (fds[1].revents & POLLIN)
+            return 1;
+        if (fds[0].revents & POLLIN)
+            return 0;
+        if (fds[0].revents & (POLLERR | POLLNVAL))
+            return -1;
+    }
+    return -1;
+}
+
+//pass the listening socket to the new process and wait until every command
+//still running here has finished. Sessions leave as soon as they are idle:
+//handed over with --handoff-sessions, closed otherwise, so this process
+//never starts another command (and never allocates another message id)
+void handOver(int channel){
+    printf("Handing over to new server process\n");
+    if (sendDescriptor(channel, create_socket, "LISTEN") == -1)
+    {
+        close(channel);
+        return;
+    }
+    //only close, a shutdown would stop the socket for the successor as well
+    close(create_socket);
+    create_socket = -1;
+    close(upgrade_socket);
+    upgrade_socket = -1;
+
+    handoffRequested = 1;
+    if (handoffPipe[1] != -1 && write(handoffPipe[1], "x", 1) == -1)
+    {
+        perror("handoff pipe");
+    }
+
+    while (!abortRequested)
+    {
+        pthread_mutex_lock(&admissionMutex);
+        int active = activeConnections;
+        pthread_mutex_unlock(&admissionMutex);
+
+        //sessions queue themselves before they stop counting as active
+        pthread_mutex_lock(&handoffMutex);
+        vector<Session*> ready;
+        ready.swap(handoffQueue);
+        pthread_mutex_unlock(&handoffMutex);
+
+        for (Session* session : ready)
+        {
+            string text = "SESSION\n" + session->authenticatedUser + "\n" + to_string(session->loginAttempts) +
+                          "\n" + (session->watching ? "1" : "0");
+            sendDescriptor(channel, session->socket, text);
+            close(session->socket);
+            delete session;
+        }
+
+        if (active == 0)
+            break;
+        usleep(100000);
+    }
+
+    sendDescriptor(channel, -1, "DONE");
+    close(channel);
+    printf("Drained, exiting\n");
+}
+
+//send text with an optional file descriptor attached (SCM_RIGHTS)
+//https://man7.org/linux/man-pages/man7/unix.7.html
+int sendDescriptor(int channel, int fd, string text){
+    struct iovec iov;
+    iov.iov_base = (void*)text.c_str();
+    iov.iov_len = text.size();
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd != -1)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if (sendmsg(channel, &msg, MSG_NOSIGNAL) == -1)
+    {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+//receive one record of sendDescriptor, *fd is -1 if none was attached
+int receiveDescriptor(int channel, int* fd, string& text){
+    char buffer[BUF];
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t size = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    if (size <= 0)
+    {
+        return -1;
+    }
+
+    *fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    text.assign(buffer, size);
+    return 0;
+}
+
+//park the session for the new process, see handOver
+void queueHandoff(Session* session){
+    Session* handoff = new Session(*session);
+    pthread_mutex_lock(&handoffMutex);
+    handoffQueue.push_back(handoff);
+    pthread_mutex_unlock(&handoffMutex);
+    session->socket = -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WATCH
+// Instead of polling LIST, a client sends WATCH and gets "NEW <id> <subject>\n"
+// pushed for every message delivered to it until it sends any line, which
+// is answered with OK. Deliveries by this process notify the subscribers
+// directly; inotify reports files that other processes link, move or write
+// into a watched mailbox. The same file is reported at most once within two seconds, as a
+// local delivery shows up on both ways.
+
+int initSpoolWatcher(){
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd == -1)
+    {
+        perror("inotify_init1");
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, s_spoolWatcher, NULL) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+void* s_spoolWatcher(void*){
+    pthread_detach(pthread_self());
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!abortRequested)
+    {
+        ssize_t size = read(inotifyFd, buffer, sizeof(buffer));
+        if (size <= 0)
+        {
+            if (size == -1 && errno == EINTR)
+                continue;
+            perror("inotify read");
+            break;
+        }
+
+        for (char* ptr = buffer; ptr < buffer + size;)
+        {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0 || event->name[0] == '.')
+                continue;
+
+            pthread_mutex_lock(&watchMutex);
+            auto it = watchedMailboxes.find(event->wd);
+            string user = it == watchedMailboxes.end() ? "" : it->second;
+            pthread_mutex_unlock(&watchMutex);
+
+            //a linked message is complete when it appears, a file created
+            //in place is reported once it is closed
+            struct stat info;
+            if (!user.empty() && (event->mask & IN_CREATE) &&
+                (stat((mailboxPath(user) + event->name).c_str(), &info) == -1 || info.st_size == 0))
+                continue;
+            if (!user.empty())
+                notifyWatchers(user, event->name);
+        }
+    }
+    return nullptr;
+}
+
+void registerWatcher(string user, Watcher* watcher){
+    pthread_mutex_lock(&watchMutex);
+    vector<Watcher*>& list = watchers[user];
+    list.push_back(watcher);
+    if (list.size() == 1)
+    {
+        //the mailbox may not exist before the first delivery
+        mkdir(mailboxPath(user).c_str(), 0777);
+        int wd = inotify_add_watch(inotifyFd, mailboxPath(user).c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd == -1)
+        {
+            perror("inotify_add_watch");
+        }
+        else
+        {
+            mailboxWatches[user] = wd;
+            watchedMailboxes[wd] = user;
+        }
+    }
+    pthread_mutex_unlock(&watchMutex);
+}
+
+void unregisterWatcher(string user, Watcher* watcher){
+    pthread_mutex_lock(&watchMutex);
+    vector<Watcher*>& list = watchers[user];
+    list.erase(remove(list.begin(), list.end(), watcher), list.end());
+    if (list.empty())
+    {
+        watchers.erase(user);
+        auto it = mailboxWatches.find(user);
+        if (it != mailboxWatches.end())
+        {
+            inotify_rm_watch(inotifyFd, it->second);
+            watchedMailboxes.erase(it->second);
+            mailboxWatches.erase(it);
+        }
+    }
+    pthread_mutex_unlock(&watchMutex);
+}
+
+void notifyWatchers(string user, string filename){
+    string key = user + "/" + filename;
+    time_t now = time(nullptr);
+
+    pthread_mutex_lock(&watchMutex);
+    auto it = watchers.find(user);
+    if (it == watchers.end())
+    {
+        pthread_mutex_unlock(&watchMutex);
+        return;
+    }
+
+    auto recent = recentDeliveries.find(key);
+    if (recent != recentDeliveries.end() && now - recent->second < 2)
+    {
+        pthread_mutex_unlock(&watchMutex);
+        return;
+    }
+    if (recentDeliveries.size() > 1000)
+    {
+        for (auto old = recentDeliveries.begin(); old != recentDeliveries.end();)
+            old = now - old->second >= 2 ? recentDeliveries.erase(old) : next(old);
+    }
+    recentDeliveries[key] = now;
+    pthread_mutex_unlock(&watchMutex);
+
+    //the subject may need a file read, which must not block the other watchers
+    unsigned long id = messageId(filename);
+    string note = id != 0 ? "NEW " + to_string(id) + " " + messageSubject(user, filename) + "\n"
+                          : "NEW " + filename + "\n";
+
+    pthread_mutex_lock(&watchMutex);
+    it = watchers.find(user);
+    if (it == watchers.end())
+    {
+        pthread_mutex_unlock(&watchMutex);
+        return;
+    }
+    for (Watcher* watcher : it->second)
+    {
+        watcher->pending.push_back(note);
+        uint64_t one = 1;
+        if (write(watcher->event, &one, sizeof(one)) == -1)
+            perror("eventfd write");
+    }
+    pthread_mutex_unlock(&watchMutex);
+}
+
+//push notifications until the client sends a line. Returns 0 when the
+//client ended WATCH, -1 if the connection is gone and 1 if the session was
+//handed over to a new server process
+int watchMailbox(Session* session, bool resumed){
+    Watcher watcher;
+    watcher.event = eventfd(0, EFD_CLOEXEC);
+    if (watcher.event == -1)
+    {
+        perror("eventfd");
+        sendMessage(&session->socket, "ERR");
+        return 0;
+    }
+    registerWatcher(session->authenticatedUser, &watcher);
+    session->watching = true;
+    if (!resumed)
+        sendMessage(&session->socket, "OK");
+
+    int result = 0;
+    while (true)
+    {
+        struct pollfd fds[3] = {{session->socket, POLLIN, 0}, {watcher.event, POLLIN, 0}, {handoffPipe[0], POLLIN, 0}};
+        if (poll(fds, 3, -1) == -1)
+        {
+            if (errno == EINTR && !abortRequested)
+                continue;
+            result = -1;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t count;
+            if (read(watcher.event, &count, sizeof(count)) == -1)
+                perror("eventfd read");
+
+            pthread_mutex_lock(&watchMutex);
+            string notifications;
+            for (string& note : watcher.pending)
+                notifications += note;
+            watcher.pending.clear();
+            pthread_mutex_unlock(&watchMutex);
+
+            if (sendAll(session->socket, notifications) == -1)
+            {
+                result = -1;
+                break;
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            char buffer[BUF];
+            if (recv(session->socket, buffer, BUF - 1, 0) <= 0)
+            {
+                result = -1;
+                break;
+            }
+            session->watching = false;
+            sendMessage(&session->socket, "OK");
+            break;
+        }
+
+        if (handoffRequested && (fds[2].revents & POLLIN))
+        {
+            result = handoffSessions ? 1 : -1;
+            break;
+        }
+    }
+
+    unregisterWatcher(session->authenticatedUser, &watcher);
+    close(watcher.event);
+    if (result == 1)
+        queueHandoff(session);
+    return result;
+}
+
+void * s_threading(void* arg){      //create thread for each client
+    cout << "A Client connected to the server!" << endl;
+    Session* session = (Session*)arg;
+
+    pthread_detach(pthread_self());
+
+    //client communication
+    clientCommunication(session);
+    if (session->socket != -1)
+    {
+        close(session->socket);
+    }
+    releaseConnection(session->address);
+    delete session;
+    return nullptr;
+}
+
+void sendMessage(int* socket, const char* msg){     //send message to client
+    PhaseTimer timer(currentTiming.reply);
+    ssize_t sent = send(*socket, msg, strlen(msg), 0);
+    if (sent == -1)
+    {
+        perror("Message send failed!");
+        return;
+    }
+    replyBytes += sent;
+    PROBE(reply_flush, *socket, sent);
+}
+
+void* clientCommunication(void* data)
+{
+    char buffer[BUF];
+    int size;
+    Session* session = (Session*)data;
+    int* current_socket = &session->socket;
+    string& authenticatedUser = session->authenticatedUser;
+    string& clientIP = session->clientIP;
+
+    ////////////////////////////////////////////////////////////////////////////
+    // SEND welcome message
+
+    struct sockaddr_in clientAddress;
+    socklen_t len = sizeof(clientAddress);
+
+    if(getpeername(*current_socket, (struct sockaddr*)&clientAddress, &len) == 0){
+        printf("IP address is: %s\n", inet_ntoa(clientAddress.sin_addr));
+        clientIP=inet_ntoa(clientAddress.sin_addr);
+    }
+    traceSession(session, TRACE_OPEN);
+
+    //a resumed client already got its welcome from the previous server process
+    buffer[0] = '\0';
+    if (!session->resumed)
+    {
+        strcpy(buffer, "Welcome to TWMailer!\r\nPlease enter one of the following commands:\r\n--> LOGIN \r\n--> SEND \r\n--> LIST \r\n--> READ (Message-Number, or a list like 1,3,5-9) \r\n--> DEL (Message-Number, or a list like 1,3,5-9) \r\n--> SYNC (changes since your last SYNC) \r\n--> WATCH (new messages are pushed until you send a line) \r\n--> QUIT \r\n");
+        if (send(*current_socket, buffer, strlen(buffer), 0) == -1)
+        {
+            perror("send failed");
+            return NULL;
+        }
+    }
+
+    do
+    {
+        /////////////////////////////////////////////////////////////////////////
+        // HAND OVER IDLE SESSION
+        // while waiting for the next command, a server restart may pass the
+        // connection on to the new process (see handOver)
+        if (handoffPipe[0] != -1 && session->pending.empty())
+        {
+            struct pollfd fds[2] = {{*current_socket, POLLIN, 0}, {handoffPipe[0], POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            //unread commands stay in the socket for whoever serves it next
+            if (handoffRequested && handoffSessions)
+            {
+                queueHandoff(session);
+                return NULL;
+            }
+            if (handoffRequested)
+            {
+                printf("Closing idle session, server restarts\n");
+                break;
+            }
+        }
+
+        //a session handed over while parked in WATCH continues watching
+        if (session->watching)
+        {
+            int watched = watchMailbox(session, true);
+            if (watched == 1)
+                return NULL;
+            if (watched == -1)
+                break;
+            continue;
+        }
+
+        /////////////////////////////////////////////////////////////////////////
+        // RECEIVE
+        if (!session->pending.empty())
+        {
+            //sent right behind a DATA chunk, taken as if just received
+            size = min(session->pending.size(), (size_t)BUF - 1);
+            memcpy(buffer, session->pending.data(), size);
+            session->pending.erase(0, size);
+        }
+        else
+        {
+            size = recv(*current_socket, buffer, BUF - 1, 0);
+        }
+        if (size == -1)
+        {
+            if (abortRequested)
+            {
+                perror("recv error after aborted");
+            }
+            else
+            {
+                perror("recv error");
+            }
+            break;
+        }
+
+        if (size == 0)
+        {
+            printf("Client closed remote socket\n"); // ignore error
+            break;
+        }
+        long long received = traceFile != nullptr || timingSize != 0 ? nowMicros() : 0;
+        size_t requestBytes = size;
+        replyBytes = 0;
+        if (timingSize != 0)
+            currentTiming = CommandTiming();
+        PROBE(command_receive, *current_socket, size);
+
+        /////////////////////////////////////////////////////////////////////////
+        // UPLOAD DATA
+        // binary chunk of a resumable upload, streamed into its spool file
+        if (size > 5 && strncmp(buffer, "DATA ", 5) == 0 && !authenticatedUser.empty() && followAddress.empty())
+        {
+            //a chunk is work like any command; a shed one is still read off
+            //the socket to stay in step, but not stored
+            bool admitted = acquireWorkSlot(true);
+            int result = receiveUploadData(current_socket, buffer, size, authenticatedUser, session->pending, admitted);
+            if (admitted)
+                releaseWorkSlot(true);
+            if (result == -1)
+            {
+                break;
+            }
+            finishCommand(session, {"DATA"}, received, requestBytes);
+            continue;
+        }
+
+        // remove ugly debug message, because of the sent newline of client
+        if (buffer[size - 2] == '\r' && buffer[size - 1] == '\n')
+        {
+            size -= 2;
+        }
+        else if (buffer[size - 1] == '\n')
+        {
+            --size;
+        }
+
+        buffer[size] = '\0';
+        //printf("Message received: %s\n", buffer); // ignore error
+
+        /*
+        if (send(*current_socket, "OK", 3, 0) == -1)
+        {
+            perror("send answer failed");
+            return NULL;
+        }
+        */
+        vector<string> msg = parseCommand(buffer);
+        PROBE(command_parse, msg[0].c_str(), msg.size());
+
+        //QUIT is always accepted, everything else needs a worker slot
+        bool authenticated = !authenticatedUser.empty();
+        //a parked WATCH must not hold a worker slot either
+        bool needsWorker = msg[0] != "QUIT" && !(authenticated && msg[0] == "WATCH");
+        if(needsWorker && !acquireWorkSlot(authenticated)){
+            sendMessage(current_socket, busyReply);
+            finishCommand(session, msg, received, requestBytes);
+            continue;
+        }
+
+        if(authenticatedUser.empty()){
+            if(msg[0] == "QUIT"){
+                printf("Client closed connection\n");
+                break;
+            }
+
+            if(msg[0] != "LOGIN"){
+                printf("Unauthorized! Login first.");
+                sendMessage(current_socket, "ERR");
+            }else{
+                loginUser(msg, session);
+            }   
+        }else{
+            if((msg[0] =="SEND" || msg[0] =="DEL" || msg[0] =="UPLOAD" || msg[0] =="COMMIT") && !followAddress.empty()){
+                sendMessage(current_socket, "ERR read-only follower");
+            }else if(msg[0] =="SEND"){        //execute functions for each command
+                if(saveMessage(msg) == -1)
+                    sendMessage(current_socket, "ERR");
+                else
+                    sendMessage(current_socket, "OK");
+            }else if(msg[0] =="LIST"){
+                listMessages(current_socket, authenticatedUser);
+            }else if(msg[0] =="READ"){
+                readMessage(msg, current_socket, authenticatedUser);
+            }else if(msg[0] =="DEL"){
+                delMessage(msg, current_socket, authenticatedUser);
+            }else if(msg[0] =="UPLOAD"){
+                startUpload(msg, current_socket, authenticatedUser);
+            }else if(msg[0] =="COMMIT"){
+                commitUpload(msg, current_socket, authenticatedUser);
+            }else if(msg[0] =="SYNC"){
+                syncMailbox(msg, current_socket, authenticatedUser);
+            }else if(msg[0] =="WATCH"){
+                int watched = watchMailbox(session, false);
+                if(watched == 1)
+                    return NULL;
+                if(watched == -1)
+                    break;
+            }else if(msg[0] =="QUIT"){
+                printf("Client closed connection\n");
+            }else{
+                sendMessage(current_socket, "Wrong Command, try again!");
+            }
+        }
+
+        if(needsWorker){
+            releaseWorkSlot(authenticated);
+        }
+        finishCommand(session, msg, received, requestBytes);
+        
+    } while (strcmp(buffer, "quit") != 0 && !abortRequested);
+
+    traceSession(session, TRACE_CLOSE);
+
+    // closes/frees the descriptor if not already
+    if (*current_socket != -1)
+    {
+        if (shutdown(*current_socket, SHUT_RDWR) == -1)
+        {
+            perror("shutdown new_socket");
+        }
+        if (close(*current_socket) == -1)
+        {
+            perror("close new_socket");
+        }
+        *current_socket = -1;
+    }
+
+    return NULL;
+}
+
+//split a received command into its lines
+vector<string> parseCommand(const char* buffer){
+    vector<string> msg;
+    string line = "";
+    stringstream ss;
+    ss << buffer << "\n";
+
+    while (getline(ss, line))       //save msg in vector
+    {
+        msg.push_back(line);
+    }
+    return msg;
+}
+
+void loginUser(vector<string> msg, Session* session){
+    if(checkBlacklisted(session->clientIP)){
+        sendMessage(&session->socket, "Zu viele Anmeldungsversuche, in einer Minute erneut versuchen");
+        return;
+    }
+    //anything but success fails, a LOGIN without password included
+    int (*authenticate)(vector<string>) = authenticator != nullptr ? authenticator : authenticateUser;
+    const char* user = msg.size() > 1 ? msg[1].c_str() : "";
+    PROBE(auth_start, user);
+    int result;
+    {
+        PhaseTimer timer(currentTiming.auth);
+        result = authenticate(msg);
+    }
+    PROBE(auth_end, user, result);
+    if(result != EXIT_SUCCESS){
+        session->loginAttempts++;
+        if(session->loginAttempts>=3){
+            blackListUser(session->clientIP);
+        }
+        sendMessage(&session->socket, "ERR");
+        return;
+    }
+    session->loginAttempts=0;
+    session->authenticatedUser = msg[1];
+    sendMessage(&session->socket, "OK");
+}
+
+//directory of a user's mailbox inside the mail spool, with trailing slash
+string mailboxPath(string user){
+    return dirname + "/" + user + "/";
+}
+
+//Save sent message in given mail spool directory
+int saveMessage(vector<string> msg){
+    if(msg.size() < 4){
+        return -1;
+    }
+    //"../x" would leave the spool, ".sync" and the like are ours
+    if(msg[1].empty() || msg[1][0] == '.' || msg[1].find('/') != string::npos){
+        return -1;
+    }
+
+    //create mailbox directory of the receiver if it does not exist yet
+    string dir = mailboxPath(msg[1]);
+    mkdir(dir.c_str(), 0777);
+
+    //written aside and given its number once complete, so LIST, READ, WATCH
+    //and the replication snapshot never see half a message
+    string tmpPath = dir + "." + to_string(getpid()) + "." + to_string(++tempFiles) + ".send";
+    string content = msg[1] + "\n" + msg[2] + "\n" + msg[3];
+    int fd;
+    {
+        PhaseTimer timer(currentTiming.spool);
+        fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    PROBE(spool_open, tmpPath.c_str(), fd == -1 ? -1 : 0);
+    if(fd == -1){
+        return -1;
+    }
+
+    //save message in the temporary file
+    bool saved;
+    {
+        PhaseTimer timer(currentTiming.spool);
+        saved = write(fd, content.data(), content.size()) == (ssize_t)content.size();
+        PROBE(spool_write, tmpPath.c_str(), content.size());
+        if(close(fd) == -1)
+            saved = false;
+        PROBE(spool_close, tmpPath.c_str(), saved ? 0 : -1);
+    }
+    if(!saved){
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+
+    //followers must see the changes in the order they happened here
+    if(replicationPort != 0)
+        pthread_mutex_lock(&replicationMutex);
+
+    //every message gets a new number, so equal subjects no longer collide
+    unsigned long id;
+    {
+        PhaseTimer timer(currentTiming.spool);
+        saved = linkMessageFile(msg[1], tmpPath, id);
+        unlink(tmpPath.c_str());
+    }
+    string filename = to_string(id) + ".txt";
+    if(saved && replicationPort != 0)
+        logChange(false, msg[1], filename, content);
+
+    if(replicationPort != 0)
+        pthread_mutex_unlock(&replicationMutex);
+
+    if(!saved){
+        return -1;
+    }
+    cacheInvalidate(msg[1], filename);
+    rememberSubject(msg[1], filename, msg[2]);
+    recordChange(msg[1], filename, false);
+    notifyWatchers(msg[1], filename);
+    return 1;
+}
+
+vector<string> listFiles(const char* directory){
+    PhaseTimer timer(currentTiming.spool);
+    DIR *dir;
+    struct dirent *file;
+    vector<string> files;
+    
+    //get all filenames from given directory and copy them into vector
+    if ((dir = opendir(directory)) != NULL) {
+        while ((file = readdir(dir)) != NULL) {
+            if(strcmp(file->d_name, ".") != 0 && strcmp(file->d_name, "..") != 0)
+                files.push_back(file->d_name);
+        }
+        closedir(dir);
+    }else{
+        cerr << "Error opening directory" << endl;
+    }
+    return files;
+}
+
+//message number of a "<id>.txt" file, 0 for anything else
+unsigned long messageId(const string& filename){
+    if(filename.size() < 5 || filename.compare(filename.size() - 4, 4, ".txt") != 0)
+        return 0;
+    for(size_t i = 0; i < filename.size() - 4; i++){
+        if(!isdigit((unsigned char)filename[i]))
+            return 0;
+    }
+    return strtoul(filename.c_str(), NULL, 10);
+}
+
+//numbers of all messages in a mailbox, ascending
+vector<unsigned long> listMessageIds(string user){
+    vector<unsigned long> ids;
+    for(string file : listFiles(mailboxPath(user).c_str())){
+        unsigned long id = messageId(file);
+        if(id != 0)
+            ids.push_back(id);
+    }
+    sort(ids.begin(), ids.end());
+    return ids;
+}
+
+//"1,3,5-9" -> ranges; a single number is a range of one
+bool parseIdSet(string spec, vector<pair<unsigned long, unsigned long>>& ranges){
+    stringstream ss(spec);
+    string part;
+    while(getline(ss, part, ',')){
+        char* end;
+        unsigned long low = strtoul(part.c_str(), &end, 10);
+        unsigned long high = low;
+        if(*end == '-')
+            high = strtoul(end + 1, &end, 10);
+        if(end == part.c_str() || *end != '\0' || low == 0 || high < low)
+            return false;
+        ranges.push_back(make_pair(low, high));
+    }
+    return !ranges.empty();
+}
+
+//ids selected by a set; single ids are kept even if missing so they can be
+//reported, ranges only select existing messages
+vector<unsigned long> selectMessageIds(string user, const vector<pair<unsigned long, unsigned long>>& ranges){
+    vector<unsigned long> selected;
+    vector<unsigned long> existing;
+    bool listed = false;
+    for(auto& range : ranges){
+        if(range.first == range.second){
+            selected.push_back(range.first);
+            continue;
+        }
+        if(!listed){
+            existing = listMessageIds(user);
+            listed = true;
+        }
+        auto it = lower_bound(existing.begin(), existing.end(), range.first);
+        for(; it != existing.end() && *it <= range.second; ++it)
+            selected.push_back(*it);
+    }
+    return selected;
+}
+
+//subjects of a mailbox from the spool scanner's index, "<file> <size> <subject>"
+map<unsigned long, string> readSubjectIndex(string user){
+    map<unsigned long, string> indexed;
+    ifstream index(dirname + "/.index/" + user);
+    string line;
+    while(getline(index, line)){
+        size_t file = line.find(' ');
+        size_t size = file == string::npos ? string::npos : line.find(' ', file + 1);
+        unsigned long id = messageId(line.substr(0, file));
+        if(size != string::npos && id != 0)
+            indexed[id] = line.substr(size + 1);
+    }
+    return indexed;
+}
+
+//second line of a message file
+string contentSubject(const string& content){
+    size_t start = content.find('\n');
+    size_t end = start == string::npos ? string::npos : content.find('\n', start + 1);
+    return start == string::npos ? "" : content.substr(start + 1, end - start - 1);
+}
+
+//subjects are written once with the message, so they are kept in memory
+void rememberSubject(string user, string filename, string subject){
+    unsigned long id = messageId(filename);
+    if(id == 0)
+        return;
+    pthread_mutex_lock(&subjectMutex);
+    auto mailbox = subjects.find(user);
+    if(mailbox != subjects.end())
+        mailbox->second[id] = subject;
+    pthread_mutex_unlock(&subjectMutex);
+}
+
+void forgetSubject(string user, string filename){
+    pthread_mutex_lock(&subjectMutex);
+    auto mailbox = subjects.find(user);
+    if(mailbox != subjects.end())
+        mailbox->second.erase(messageId(filename));
+    pthread_mutex_unlock(&subjectMutex);
+}
+
+//subject line of a message, from memory, the index, the cache or the file
+string messageSubject(string user, string filename){
+    unsigned long id = messageId(filename);
+    if(id != 0){
+        pthread_mutex_lock(&subjectMutex);
+        bool known = subjects.count(user) != 0;
+        pthread_mutex_unlock(&subjectMutex);
+        //first use of the mailbox: read the index outside the lock
+        map<unsigned long, string> indexed;
+        if(!known){
+            PhaseTimer timer(currentTiming.spool);
+            indexed = readSubjectIndex(user);
+        }
+
+        pthread_mutex_lock(&subjectMutex);
+        map<unsigned long, string>& mailbox = subjects[user];
+        if(!known)
+            mailbox.insert(indexed.begin(), indexed.end());
+        auto it = mailbox.find(id);
+        if(it != mailbox.end()){
+            string subject = it->second;
+            pthread_mutex_unlock(&subjectMutex);
+            return subject;
+        }
+        pthread_mutex_unlock(&subjectMutex);
+    }
+
+    string subject;
+    string content;
+    if(cacheLookup(user, filename, content)){
+        subject = contentSubject(content);
+    }else{
+        PhaseTimer timer(currentTiming.spool);
+        ifstream file(mailboxPath(user) + filename);
+        getline(file, subject);
+        getline(file, subject);
+        //a file written in place by someone else may still be incomplete
+        if(!file || file.eof())
+            return subject;
+    }
+    rememberSubject(user, filename, subject);
+    return subject;
+}
+
+//LIST: <count>\n followed by "<id> <subject>\n" per message
+void listMessages(int* socket, string authenticatedUser){
+    vector<unsigned long> ids = listMessageIds(authenticatedUser);
+
+    string response = to_string(ids.size()) + "\n";
+    for(unsigned long id : ids){
+        response += to_string(id) + " " + messageSubject(authenticatedUser, to_string(id) + ".txt") + "\n";
+    }
+    sendAll(*socket, response);
+}
+
+//file content of a message, from the cache if possible
+bool loadMessage(string user, string filename, string& content){
+    //repeated reads of the same message are served from memory
+    unsigned long generation = 0;
+    if(cacheLookup(user, filename, content, &generation)){
+        return true;
+    }
+
+    {
+        PhaseTimer timer(currentTiming.spool);
+        string path = mailboxPath(user) + filename;
+        ifstream newfile;
+        newfile.open(path, ios::in);        //open file 
+        PROBE(spool_open, path.c_str(), newfile.is_open() ? 0 : -1);
+        if(!newfile.is_open()){
+            return false;
+        }
+
+        stringstream fileText;
+        fileText << newfile.rdbuf();        //get content from file
+        content = fileText.str();
+        newfile.close(); //close the file object
+    }
+    if(content.empty() || content.back() != '\n'){
+        content += "\n";
+    }
+
+    cacheInsert(user, filename, content, generation);
+    return true;
+}
+
+//READ <id>: OK <size>\n<content>
+//READ <set>: OK <count>\n then per message "<id> <size>\n<content>" or "<id> ERR\n"
+void readMessage(vector<string> msg, int* socket, string authenticatedUser){
+    vector<pair<unsigned long, unsigned long>> ranges;
+    if(msg.size() < 2 || !parseIdSet(msg[1], ranges)){
+        sendMessage(socket, "ERR");
+        return;
+    }
+
+    string content;
+    bool single = msg[1].find_first_of(",-") == string::npos;
+    if(single){
+        if(!loadMessage(authenticatedUser, msg[1] + ".txt", content)){
+            sendMessage(socket, "ERR");
+            return;
+        }
+        sendAll(*socket, "OK " + to_string(content.size()) + "\n" + content);
+        return;
+    }
+
+    vector<unsigned long> ids = selectMessageIds(authenticatedUser, ranges);
+    string response = "OK " + to_string(ids.size()) + "\n";
+    for(unsigned long id : ids){
+        if(loadMessage(authenticatedUser, to_string(id) + ".txt", content))
+            response += to_string(id) + " " + to_string(content.size()) + "\n" + content;
+        else
+            response += to_string(id) + " ERR\n";
+    }
+    sendAll(*socket, response);
+}
+
+//remove one message and tell the cache, the journal and the followers
+bool deleteMessage(string user, string filename){
+    if(replicationPort != 0)
+        pthread_mutex_lock(&replicationMutex);
+
+    //remove file from dir
+    bool removed;
+    {
+        PhaseTimer timer(currentTiming.spool);
+        removed = remove((mailboxPath(user) + filename).c_str()) == 0;
+    }
+    if(removed && replicationPort != 0)
+        logChange(true, user, filename, "");
+
+    if(replicationPort != 0)
+        pthread_mutex_unlock(&replicationMutex);
+
+    if(removed){
+        cacheInvalidate(user, filename);
+        forgetSubject(user, filename);
+        recordChange(user, filename, true);
+    }
+    return removed;
+}
+
+//DEL <id>: OK or ERR, DEL <set>: OK <deleted> of <selected>
+void delMessage(vector<string> msg, int* socket, string authenticatedUser){
+    vector<pair<unsigned long, unsigned long>> ranges;
+    if(msg.size() < 2 || !parseIdSet(msg[1], ranges)){
+        sendMessage(socket, "ERR");
+        return;
+    }
+
+    vector<unsigned long> ids = selectMessageIds(authenticatedUser, ranges);
+    size_t deleted = 0;
+    for(unsigned long id : ids){
+        if(deleteMessage(authenticatedUser, to_string(id) + ".txt"))
+            deleted++;
+    }
+
+    if(msg[1].find_first_of(",-") == string::npos)
+        sendMessage(socket, deleted == 1 ? "OK" : "ERR");
+    else
+        sendAll(*socket, "OK " + to_string(deleted) + " of " + to_string(ids.size()));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UPLOAD
+// SEND has to fit into one receive buffer. Large messages are uploaded in
+// chunks instead, written straight to a spool file so memory use does not
+// depend on the message size, and moved into the mailbox when complete:
+//   UPLOAD\n<receiver>\n<subject>\n<size>\n   -> OK <token> 0
+//   UPLOAD\n<token>\n                         -> OK <token> <offset>
+//   DATA <token> <offset> <length>\n<bytes>   -> OK <offset> | ERR <offset>
+//   COMMIT\n<token>\n                         -> OK <id>
+// After a lost connection the client asks for the offset with the token and
+// continues from there. Unfinished uploads expire after a day.
+
+string uploadPath(string token){
+    return dirname + "/.uploads/" + token;
+}
+
+bool loadUpload(string token, Upload& upload){
+    if(token.empty() || token.find_first_not_of("0123456789abcdef") != string::npos){
+        return false;
+    }
+    ifstream meta(uploadPath(token) + ".meta");
+    string size, headerSize;
+    if(!getline(meta, upload.user) || !getline(meta, upload.receiver) || !getline(meta, upload.subject) ||
+       !getline(meta, size) || !getline(meta, headerSize)){
+        return false;
+    }
+    upload.size = strtoul(size.c_str(), NULL, 10);
+    upload.headerSize = strtoul(headerSize.c_str(), NULL, 10);
+    return true;
+}
+
+//body bytes already stored
+unsigned long uploadOffset(string token, const Upload& upload){
+    struct stat info;
+    if(stat(uploadPath(token).c_str(), &info) == -1 || (unsigned long)info.st_size < upload.headerSize){
+        return 0;
+    }
+    return info.st_size - upload.headerSize;
+}
+
+void expireUploads(){
+    string dir = dirname + "/.uploads/";
+    //a fresh spool has none yet
+    mkdir(dir.c_str(), 0777);
+    time_t now = time(nullptr);
+    for(string file : listFiles(dir.c_str())){
+        struct stat info;
+        if(stat((dir + file).c_str(), &info) == 0 && now - info.st_mtime > UPLOAD_EXPIRY){
+            remove((dir + file).c_str());
+        }
+    }
+}
+
+void startUpload(vector<string> msg, int* socket, string authenticatedUser){
+    Upload upload;
+    string token;
+
+    if(msg.size() == 2){
+        //resume
+        token = msg[1];
+        if(!loadUpload(token, upload) || upload.user != authenticatedUser){
+            sendMessage(socket, "ERR");
+            return;
+        }
+    }else if(msg.size() >= 4){
+        upload.user = authenticatedUser;
+        upload.receiver = msg[1];
+        upload.subject = msg[2];
+        upload.size = strtoul(msg[3].c_str(), NULL, 10);
+        if(upload.receiver.empty() || upload.receiver.find('/') != string::npos || upload.receiver[0] == '.'){
+            sendMessage(socket, "ERR");
+            return;
+        }
+
+        unsigned char random[16];
+        ifstream urandom("/dev/urandom", ios::binary);
+        if(!urandom.read((char*)random, sizeof(random))){
+            sendMessage(socket, "ERR");
+            return;
+        }
+        char hex[3];
+        for(unsigned char byte : random){
+            snprintf(hex, sizeof(hex), "%02x", byte);
+            token += hex;
+        }
+
+        //the spool file starts with the header lines saveMessage writes
+        string header = upload.receiver + "\n" + upload.subject + "\n";
+        upload.headerSize = header.size();
+        mkdir((dirname + "/.uploads").c_str(), 0777);
+        ofstream data(uploadPath(token), ios::binary | ios::trunc);
+        data << header;
+        data.close();
+        ofstream meta(uploadPath(token) + ".meta", ios::trunc);
+        meta << upload.user << "\n" << upload.receiver << "\n" << upload.subject << "\n"
+             << upload.size << "\n" << upload.headerSize << "\n";
+        meta.close();
+        if(data.fail() || meta.fail()){
+            sendMessage(socket, "ERR");
+            return;
+        }
+    }else{
+        sendMessage(socket, "ERR");
+        return;
+    }
+
+    string response = "OK " + token + " " + to_string(uploadOffset(token, upload));
+    sendMessage(socket, response.c_str());
+}
+
+//buffer holds the first size bytes received: the DATA line and the start of
+//the chunk. Bytes pipelined after the chunk are returned in leftover. A
+//chunk that was not admitted is only consumed and answered with ERR.
+//Returns -1 if the connection broke.
+int receiveUploadData(int* socket, char* buffer, int size, string authenticatedUser, string& leftover, bool admitted){
+    string header(buffer, size);
+    size_t end;
+    while((end = header.find('\n')) == string::npos && header.size() < BUF){
+        char more[BUF];
+        int n = recv(*socket, more, BUF - header.size(), 0);
+        if(n <= 0)
+            return -1;
+        header.append(more, n);
+    }
+    if(end == string::npos)
+        return -1;
+
+    string command, token;
+    unsigned long offset = 0, length = 0;
+    stringstream(header.substr(0, end)) >> command >> token >> offset >> length;
+    string initial = header.substr(end + 1, length);
+    unsigned long remaining = length - initial.size();
+    leftover = header.substr(min(header.size(), end + 1 + initial.size()));
+
+    //only append where the stored data ends; the chunk is consumed either way
+    Upload upload;
+    bool known = loadUpload(token, upload) && upload.user == authenticatedUser;
+    bool valid = admitted && known && offset == uploadOffset(token, upload) && offset + length <= upload.size;
+    int fd = valid ? open(uploadPath(token).c_str(), O_WRONLY | O_APPEND) : -1;
+    if(fd != -1 && write(fd, initial.data(), initial.size()) != (ssize_t)initial.size()){
+        close(fd);
+        fd = -1;
+    }
+
+    char chunk[UPLOAD_CHUNK];
+    while(remaining > 0){
+        int n = recv(*socket, chunk, min(remaining, (unsigned long)sizeof(chunk)), 0);
+        if(n <= 0){
+            if(fd != -1)
+                close(fd);
+            return -1;
+        }
+        if(fd != -1 && write(fd, chunk, n) != n){
+            close(fd);
+            fd = -1;
+        }
+        remaining -= n;
+    }
+    if(fd != -1)
+        close(fd);
+
+    unsigned long stored = known ? uploadOffset(token, upload) : 0;
+    string response = (fd != -1 ? "OK " : "ERR ") + to_string(stored);
+    sendMessage(socket, response.c_str());
+    return 0;
+}
+
+//move a complete upload into the mailbox like saveMessage does
+void commitUpload(vector<string> msg, int* socket, string authenticatedUser){
+    Upload upload;
+    if(msg.size() < 2 || !loadUpload(msg[1], upload) || upload.user != authenticatedUser ||
+       uploadOffset(msg[1], upload) != upload.size){
+        sendMessage(socket, "ERR");
+        return;
+    }
+
+    mkdir(mailboxPath(upload.receiver).c_str(), 0777);
+
+    if(replicationPort != 0)
+        pthread_mutex_lock(&replicationMutex);
+
+    //same file system, so the message appears complete or not at all
+    unsigned long id;
+    bool moved;
+    {
+        PhaseTimer timer(currentTiming.spool);
+        moved = linkMessageFile(upload.receiver, uploadPath(msg[1]), id);
+        if(moved)
+            unlink(uploadPath(msg[1]).c_str());
+    }
+    string filename = to_string(id) + ".txt";
+    string path = mailboxPath(upload.receiver) + filename;
+    PROBE(spool_close, path.c_str(), moved ? 0 : -1);
+    if(moved && replicationPort != 0){
+        //the change log keeps message contents in memory, uploads included
+        ifstream file(mailboxPath(upload.receiver) + filename, ios::binary);
+        stringstream content;
+        content << file.rdbuf();
+        logChange(false, upload.receiver, filename, content.str());
+    }
+
+    if(replicationPort != 0)
+        pthread_mutex_unlock(&replicationMutex);
+
+    if(!moved){
+        sendMessage(socket, "ERR");
+        return;
+    }
+    remove((uploadPath(msg[1]) + ".meta").c_str());
+    cacheInvalidate(upload.receiver, filename);
+    rememberSubject(upload.receiver, filename, upload.subject);
+    recordChange(upload.receiver, filename, false);
+    notifyWatchers(upload.receiver, filename);
+
+    string response = "OK " + to_string(id);
+    sendMessage(socket, response.c_str());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LOCAL DELIVERY
+// --local-socket PATH accepts SOCK_SEQPACKET connections from this host. The
+// peer's uid is taken from the kernel (SO_PEERCRED); root, the server's own
+// user and every --local-uid may deliver, nobody else. Each record is
+//   DELIVER\n<receiver>\n<subject>
+// with the descriptor of the message body attached (SCM_RIGHTS), answered by
+// "OK <id>" or "ERR ...". The body never passes through the socket: it is
+// copied inside the kernel with copy_file_range where the file systems allow
+// it. A hard link is not possible because the spool file starts with the
+// receiver and subject lines.
+
+int openLocalSocket(){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, localSocketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    //everybody may connect, who may deliver is decided by uid
+    unlink(address.sun_path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock == -1 ||
+        bind(sock, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        chmod(address.sun_path, 0666) == -1 ||
+        listen(sock, SOMAXCONN) == -1)
+    {
+        perror("local socket");
+        if (sock != -1)
+            close(sock);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, s_localListener, (void*)(intptr_t)sock) != 0)
+    {
+        perror("pthread_create");
+        close(sock);
+        return -1;
+    }
+    local_socket = sock;
+    printf("Accepting local deliveries on %s\n", localSocketPath.c_str());
+    return 0;
+}
+
+void* s_localListener(void* arg){
+    int sock = (int)(intptr_t)arg;
+    pthread_detach(pthread_self());
+
+    while (!abortRequested)
+    {
+        int fd = accept(sock, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (!abortRequested)
+                perror("accept local client");
+            break;
+        }
+
+        //https://man7.org/linux/man-pages/man7/unix.7.html
+        struct ucred peer;
+        socklen_t len = sizeof(peer);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) == -1 ||
+            (peer.uid != 0 && peer.uid != geteuid() && localUids.count(peer.uid) == 0))
+        {
+            sendDescriptor(fd, -1, "ERR not trusted");
+            close(fd);
+            continue;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, s_localDelivery, (void*)(intptr_t)fd) != 0)
+        {
+            perror("pthread_create");
+            close(fd);
+        }
+    }
+    return nullptr;
+}
+
+//serve one local client until it hangs up
+void* s_localDelivery(void* arg){
+    int fd = (int)(intptr_t)arg;
+    pthread_detach(pthread_self());
+
+    int body;
+    string text;
+    while (receiveDescriptor(fd, &body, text) == 0)
+    {
+        vector<string> fields;
+        string line;
+        stringstream ss(text);
+        while (getline(ss, line))
+        {
+            fields.push_back(line);
+        }
+
+        string response;
+        unsigned long id;
+        if (fields.size() == 1 && fields[0] == "QUIT")
+        {
+            if (body != -1)
+                close(body);
+            break;
+        }
+        if (fields.size() != 3 || fields[0] != "DELIVER" || body == -1)
+            response = "ERR usage: DELIVER\n<receiver>\n<subject> with the body attached";
+        else if (!followAddress.empty())
+            response = "ERR read-only follower";
+        else if (!deliverLocal(fields[1], fields[2], body, id))
+            response = "ERR";
+        else
+            response = "OK " + to_string(id);
+
+        if (body != -1)
+            close(body);
+        if (sendDescriptor(fd, -1, response) == -1)
+            break;
+    }
+    close(fd);
+    return nullptr;
+}
+
+//append everything readable from body to out, in the kernel if possible
+bool copyBody(int body, int out){
+    struct stat info;
+    if (fstat(body, &info) == 0 && S_ISREG(info.st_mode))
+    {
+        //https://man7.org/linux/man-pages/man2/copy_file_range.2.html
+        //an explicit offset leaves the sender's file position alone
+        loff_t offset = 0;
+        while (offset < info.st_size)
+        {
+            ssize_t n = copy_file_range(body, &offset, out, NULL, info.st_size - offset, 0);
+            if (n == 0)
+                return true;
+            if (n == -1)
+            {
+                if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+                    return false;
+                //older kernels and some file systems can't, copy the rest
+                if (lseek(body, offset, SEEK_SET) == -1)
+                    return false;
+                break;
+            }
+        }
+        if (offset >= info.st_size)
+            return true;
+    }
+
+    //pipes, sockets and the fallback above
+    char buffer[UPLOAD_CHUNK];
+    ssize_t n;
+    while ((n = read(body, buffer, sizeof(buffer))) > 0)
+    {
+        if (write(out, buffer, n) != n)
+            return false;
+    }
+    return n == 0;
+}
+
+//store a local message like saveMessage does
+bool deliverLocal(string receiver, string subject, int body, unsigned long& id){
+    if (receiver.empty() || receiver[0] == '.' || receiver.find('/') != string::npos)
+        return false;
+
+    string dir = mailboxPath(receiver);
+    mkdir(dir.c_str(), 0777);
+
+    //the number is only taken once the message is complete; the pid keeps
+    //the temporary names of two server processes apart
+    string tmpPath = dir + "." + to_string(getpid()) + "." + to_string(++tempFiles) + ".local";
+    int out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    PROBE(spool_open, tmpPath.c_str(), out == -1 ? -1 : 0);
+    if (out == -1)
+    {
+        perror("local delivery");
+        return false;
+    }
+    string header = receiver + "\n" + subject + "\n";
+    bool written = write(out, header.data(), header.size()) == (ssize_t)header.size() && copyBody(body, out);
+    if (close(out) == -1)
+        written = false;
+    PROBE(spool_close, tmpPath.c_str(), written ? 0 : -1);
+    if (!written)
+    {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    if (replicationPort != 0)
+        pthread_mutex_lock(&replicationMutex);
+
+    //readers see the whole message or nothing
+    bool moved = linkMessageFile(receiver, tmpPath, id);
+    unlink(tmpPath.c_str());
+    string filename = to_string(id) + ".txt";
+    if (moved && replicationPort != 0)
+    {
+        ifstream file(dir + filename, ios::binary);
+        stringstream content;
+        content << file.rdbuf();
+        logChange(false, receiver, filename, content.str());
+    }
+
+    if (replicationPort != 0)
+        pthread_mutex_unlock(&replicationMutex);
+
+    if (!moved)
+    {
+        return false;
+    }
+    cacheInvalidate(receiver, filename);
+    rememberSubject(receiver, filename, subject);
+    recordChange(receiver, filename, false);
+    notifyWatchers(receiver, filename);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TRACE
+// --trace FILE records every session for twmailer-replay: when it started,
+// each command with its latency and request and reply sizes, and when it
+// ended (format in SessionTrace.h). Only command names and the message
+// numbers or modseq given to READ, DEL and SYNC are kept as text. User names
+// are hashed with a key that is drawn at startup and never stored;
+// passwords, subjects, bodies, tokens and every other field are reduced to
+// their length. Records are buffered and flushed once a second.
+
+long long nowMicros(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int openTrace(){
+    traceFile = fopen(tracePath.c_str(), "wb");
+    if (traceFile == nullptr)
+    {
+        perror("trace file");
+        return -1;
+    }
+    setvbuf(traceFile, NULL, _IOFBF, 1 << 16);
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), traceFile);
+
+    ifstream random("/dev/urandom", ios::binary);
+    random.read((char*)&traceKey, sizeof(traceKey));
+    traceEpoch = traceFlushed = nowMicros();
+    printf("Tracing sessions to %s\n", tracePath.c_str());
+    return 0;
+}
+
+void writeTrace(const string& record){
+    pthread_mutex_lock(&traceMutex);
+    if (traceFile != nullptr)
+    {
+        fwrite(record.data(), 1, record.size(), traceFile);
+        long long now = nowMicros();
+        if (now - traceFlushed > 1000000)
+        {
+            fflush(traceFile);
+            traceFlushed = now;
+        }
+    }
+    pthread_mutex_unlock(&traceMutex);
+}
+
+void traceSession(Session* session, TraceRecordType type){
+    if (type == TRACE_OPEN)
+        session->traceId = ++traceSessions;
+    if (traceFile == nullptr)
+        return;
+
+    string record(1, (char)type);
+    traceVarint(record, session->traceId);
+    traceVarint(record, nowMicros() - traceEpoch);
+    writeTrace(record);
+}
+
+void traceCommand(Session* session, const vector<string>& msg, long long start, size_t requestBytes){
+    if (traceFile == nullptr || msg.empty())
+        return;
+    long long now = nowMicros();
+
+    string record(1, (char)TRACE_COMMAND);
+    traceVarint(record, session->traceId);
+    traceVarint(record, start - traceEpoch);
+    traceVarint(record, now - start);
+    traceVarint(record, requestBytes);
+    traceVarint(record, replyBytes);
+    record += (char)min(msg.size(), (size_t)255);
+
+    for (size_t i = 0; i < msg.size() && i < 255; i++)
+    {
+        const string& field = msg[i];
+        //chosen by position, never by content: an all-digit password or
+        //subject is as secret as any other
+        bool numbers = i == 1 && (msg[0] == "READ" || msg[0] == "DEL" || msg[0] == "SYNC") &&
+                       !field.empty() && field.find_first_not_of("0123456789,-") == string::npos;
+        bool user = i == 1 && (msg[0] == "LOGIN" || msg[0] == "SEND" || (msg[0] == "UPLOAD" && msg.size() > 2));
+
+        if (i == 0 || numbers)
+        {
+            record += (char)FIELD_TEXT;
+            traceVarint(record, field.size());
+            record += field;
+        }
+        else if (user)
+        {
+            //FNV-1a over key and name, the same name always maps the same
+            uint64_t hash = 14695981039346656037ULL ^ traceKey;
+            for (unsigned char c : field)
+                hash = (hash ^ c) * 1099511628211ULL;
+            record += (char)FIELD_HASH;
+            traceVarint(record, field.size());
+            record.append((const char*)&hash, sizeof(hash));
+        }
+        else
+        {
+            record += (char)FIELD_REDACTED;
+            traceVarint(record, field.size());
+        }
+    }
+    writeTrace(record);
+}
+
+void closeTrace(){
+    pthread_mutex_lock(&traceMutex);
+    if (traceFile != nullptr)
+    {
+        fclose(traceFile);
+        traceFile = nullptr;
+    }
+    pthread_mutex_unlock(&traceMutex);
+}
+
+//end of a command: trace file, timing ring and tracepoint
+void finishCommand(Session* session, const vector<string>& msg, long long start, size_t requestBytes){
+    traceCommand(session, msg, start, requestBytes);
+    recordTiming(session, msg, start);
+    PROBE(command_done, msg[0].c_str(), replyBytes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TIMING
+// --timing N keeps the last N commands of every session thread with the time
+// spent waiting for a worker slot, in LDAP, on spool files and on sending the
+// reply; the rest (parsing, locks, cache) is "other". Each thread writes only
+// its own ring, so recording takes no lock. kill -USR1 prints all rings,
+// oldest command first, one line per command:
+//   2026-10-18 14:03:11.204118 session=7 ip=10.0.0.5 user=if20b000 LOGIN
+//     total=81234 queue=0 auth=80911 spool=0 reply=35 other=288
+// Rings of ended threads are taken over by new ones, so there are at most as
+// many rings as sessions ran at the same time. The tracepoints in Probes.h
+// show the same phases to perf and bpftrace.
+
+//the calling thread's ring, one left by an ended thread if there is one
+TimingRing* threadTimingRing(){
+    if (ringHolder.ring != nullptr)
+        return ringHolder.ring;
+
+    pthread_mutex_lock(&timingMutex);
+    for (TimingRing* ring : timingRings)
+    {
+        bool owned = false;
+        if (ring->owned.compare_exchange_strong(owned, true, memory_order_acquire))
+        {
+            ringHolder.ring = ring;
+            break;
+        }
+    }
+    if (ringHolder.ring == nullptr)
+    {
+        TimingRing* ring = new TimingRing();
+        ring->head = 0;
+        ring->claimed = 0;
+        ring->owned = true;
+        ring->entries = new CommandTiming[timingSize]();
+        timingRings.push_back(ring);
+        ringHolder.ring = ring;
+    }
+    pthread_mutex_unlock(&timingMutex);
+    return ringHolder.ring;
+}
+
+void recordTiming(Session* session, const vector<string>& msg, long long start){
+    if (timingSize == 0)
+        return;
+    TimingRing* ring = threadTimingRing();
+    unsigned long head = ring->head.load(memory_order_relaxed);
+    ring->claimed.store(head + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    CommandTiming& entry = ring->entries[head % timingSize];
+    entry = currentTiming;
+    entry.start = start;
+    entry.total = nowMicros() - start;
+    entry.session = session->traceId;
+    //a failed LOGIN is shown with the name it tried
+    bool login = session->authenticatedUser.empty() && msg[0] == "LOGIN" && msg.size() > 1;
+    snprintf(entry.command, sizeof(entry.command), "%s", msg[0].c_str());
+    snprintf(entry.user, sizeof(entry.user), "%s", login ? msg[1].c_str() : session->authenticatedUser.c_str());
+    snprintf(entry.clientIP, sizeof(entry.clientIP), "%s", session->clientIP.c_str());
+
+    //publish only the finished entry
+    ring->head.store(head + 1, memory_order_release);
+}
+
+void dumpTimings(){
+    if (timingSize == 0)
+    {
+        printf("Command timing is off, start the server with --timing N\n");
+        return;
+    }
+
+    vector<CommandTiming> commands;
+    pthread_mutex_lock(&timingMutex);
+    for (TimingRing* ring : timingRings)
+    {
+        unsigned long end = ring->head.load(memory_order_acquire);
+        unsigned long begin = end > timingSize ? end - timingSize : 0;
+        size_t first = commands.size();
+        for (unsigned long i = begin; i < end; i++)
+            commands.push_back(ring->entries[i % timingSize]);
+
+        //drop the slots the owner has (over)written since, like a seqlock
+        atomic_thread_fence(memory_order_acquire);
+        unsigned long claimed = ring->claimed.load(memory_order_relaxed);
+        unsigned long valid = claimed > timingSize ? claimed - timingSize : 0;
+        if (valid > begin)
+            commands.erase(commands.begin() + first, commands.begin() + first + min(valid, end) - begin);
+    }
+    pthread_mutex_unlock(&timingMutex);
+
+    sort(commands.begin(), commands.end(), [](const CommandTiming& a, const CommandTiming& b){
+        return a.start < b.start;
+    });
+
+    //entries carry monotonic times, print them as wall clock
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    long long offset = (long long)tv.tv_sec * 1000000 + tv.tv_usec - nowMicros();
+
+    printf("Command timings (microseconds), %zu commands:\n", commands.size());
+    for (const CommandTiming& command : commands)
+    {
+        long long wall = command.start + offset;
+        time_t seconds = wall / 1000000;
+        struct tm local;
+        char stamp[32];
+        localtime_r(&seconds, &local);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+        long long other = command.total - command.queue - command.auth - command.spool - command.reply;
+        printf("%s.%06lld session=%lu ip=%s user=%s %s total=%lld queue=%lld auth=%lld spool=%lld reply=%lld other=%lld\n",
+            stamp, wall % 1000000, (unsigned long)command.session, command.clientIP,
+            command.user[0] != '\0' ? command.user : "-", command.command,
+            command.total, command.queue, command.auth, command.spool, command.reply, other);
+    }
+    fflush(stdout);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SYNC
+// Every SEND and DEL appends "<modseq> +|- <filename>" to the mailbox's
+// journal in <spool>/.sync/<user>. "SYNC\n<token>\n" returns only what
+// changed since then:
+//   <count> <token>[ FULL]\n followed by count lines "+ <file> <subject>"
+//   or "- <file>", so a client can keep the headers of its mailbox
+// A token is "<epoch>-<modseq>". Modseqs only mean something to the journal
+// that counted them, and each journal draws its epoch when it is started,
+// so a follower, a migrated spool or another backend behind a router
+// rejects the tokens of the old one. FULL means the client has to replace
+// its listing: it asked for 0, for another journal, for a sequence older
+// than the journal's floor or for one it never reached. Once the journal
+// gets long it is rewritten with only the last entry per file and without
+// removals. Files put into a mailbox by other means than the server show up
+// in LIST at once but in SYNC only after twmailer-fsck --repair (or a start
+// with --fsck) journaled them.
+
+string journalPath(string user){
+    return dirname + "/.sync/" + user;
+}
+
+//journal state of a mailbox, caller holds syncMutex
+MailboxJournal& loadJournal(string user){
+    auto it = journals.find(user);
+    if(it != journals.end()){
+        return it->second;
+    }
+
+    //message numbers are never reused, not even those of deleted messages
+    MailboxJournal journal = {0, 0, 0, 1, JOURNAL_COMPACT, 0, 0, 0};
+    int fd = lockJournal(user, journal);
+    if(fd != -1)
+        close(fd);
+    for(unsigned long id : listMessageIds(user))
+        journal.nextId = max(journal.nextId, id + 1);
+    return journals[user] = journal;
+}
+
+//During a restart the old server still appends to the same journals, so
+//the file is locked for every access and what the other process added
+//since is taken in first; modseqs then keep growing across both. Returns
+//the locked descriptor, closing it unlocks. Caller holds syncMutex.
+int lockJournal(string user, MailboxJournal& journal){
+    PhaseTimer timer(currentTiming.spool);
+    string path = journalPath(user);
+    mkdir((dirname + "/.sync").c_str(), 0777);
+    int fd;
+    while(true){
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if(fd == -1){
+            perror(path.c_str());
+            return -1;
+        }
+        if(flock(fd, LOCK_EX) == -1){
+            perror("flock");
+            close(fd);
+            return -1;
+        }
+        //a compaction replaces the file, the lock has to be on the current one
+        struct stat locked, current;
+        if(fstat(fd, &locked) == 0 && stat(path.c_str(), &current) == 0 && locked.st_ino == current.st_ino)
+            break;
+        close(fd);
+    }
+
+    struct stat info;
+    fstat(fd, &info);
+    if(info.st_ino != journal.inode || info.st_size < journal.length){
+        //new or compacted: read all of it
+        journal.inode = info.st_ino;
+        journal.length = 0;
+        journal.entries = 0;
+    }
+    string tail(info.st_size - journal.length, '\0');
+    ssize_t got = tail.empty() ? 0 : pread(fd, &tail[0], tail.size(), journal.length);
+    tail.resize(got > 0 ? got : 0);
+    journal.length += tail.size();
+
+    stringstream lines(tail);
+    string line;
+    while(getline(lines, line)){
+        if(line.compare(0, 8, "# epoch ") == 0){
+            journal.epoch = strtoul(line.c_str() + 8, NULL, 10);
+            continue;
+        }
+        if(line.compare(0, 8, "# floor ") == 0){
+            journal.floor = max(journal.floor, strtoul(line.c_str() + 8, NULL, 10));
+            journal.modseq = max(journal.modseq, journal.floor);
+            continue;
+        }
+        if(line.compare(0, 9, "# nextid ") == 0){
+            journal.nextId = max(journal.nextId, strtoul(line.c_str() + 9, NULL, 10));
+            continue;
+        }
+        journal.modseq = max(journal.modseq, strtoul(line.c_str(), NULL, 10));
+        journal.entries++;
+        size_t op = line.find(' ');
+        if(op != string::npos && line.size() > op + 3)
+            journal.nextId = max(journal.nextId, messageId(line.substr(op + 3)) + 1);
+    }
+
+    //a new journal, or one from before epochs: old tokens must not match
+    if(journal.epoch == 0){
+        uint32_t epoch = 0;
+        ifstream random("/dev/urandom", ios::binary);
+        random.read((char*)&epoch, sizeof(epoch));
+        journal.epoch = epoch != 0 ? epoch : (unsigned long)time(nullptr);
+        string header = "# epoch " + to_string(journal.epoch) + "\n";
+        if(write(fd, header.data(), header.size()) == (ssize_t)header.size())
+            journal.length += header.size();
+    }
+    return fd;
+}
+
+unsigned long allocateMessageId(string user){
+    pthread_mutex_lock(&syncMutex);
+    unsigned long id = loadJournal(user).nextId++;
+    pthread_mutex_unlock(&syncMutex);
+    return id;
+}
+
+//the next numbers only count for this process: during a restart the old
+//server still finishes its commands on the same spool. A message file is
+//therefore only ever created exclusively, a taken number is skipped.
+
+//give a complete file (same file system) a message number; the caller
+//removes the old name once the change is recorded
+bool linkMessageFile(string user, string from, unsigned long& id){
+    while(true){
+        id = allocateMessageId(user);
+        if(link(from.c_str(), (mailboxPath(user) + to_string(id) + ".txt").c_str()) == 0)
+            return true;
+        if(errno != EEXIST)
+            return false;
+    }
+}
+
+//give the files of the old one-file-per-subject layout a message number;
+//followers get the renamed files from their primary instead
+void migrateSpool(){
+    for(string user : listFiles(dirname.c_str())){
+        if(user[0] == '.')
+            continue;
+        for(string file : listFiles(mailboxPath(user).c_str())){
+            if(file[0] == '.' || messageId(file) != 0)
+                continue;
+            unsigned long id;
+            if(linkMessageFile(user, mailboxPath(user) + file, id)){
+                string filename = to_string(id) + ".txt";
+                unlink((mailboxPath(user) + file).c_str());
+                recordChange(user, file, true);
+                recordChange(user, filename, false);
+                printf("Numbered %s/%s as %s\n", user.c_str(), file.c_str(), filename.c_str());
+            }
+        }
+    }
+}
+
+unsigned long recordChange(string user, string filename, bool removed){
+    pthread_mutex_lock(&syncMutex);
+    MailboxJournal& journal = loadJournal(user);
+    int fd = lockJournal(user, journal);
+    unsigned long modseq = ++journal.modseq;
+
+    if(fd != -1){
+        PhaseTimer timer(currentTiming.spool);
+        string line = to_string(modseq) + (removed ? " - " : " + ") + filename + "\n";
+        if(write(fd, line.data(), line.size()) == (ssize_t)line.size()){
+            journal.length += line.size();
+            journal.entries++;
+        }
+    }
+
+    if(fd != -1 && journal.entries > journal.compactAt){
+        compactJournal(user, journal);
+    }
+    if(fd != -1)
+        close(fd);
+    pthread_mutex_unlock(&syncMutex);
+    return modseq;
+}
+
+//keep the last entry per file and drop removals, caller holds syncMutex
+void compactJournal(string user, MailboxJournal& journal){
+    map<string, pair<unsigned long, bool>> latest;
+    ifstream in(journalPath(user));
+    string line;
+    while(getline(in, line)){
+        if(line[0] == '#')
+            continue;
+        size_t op = line.find(' ');
+        if(op == string::npos || line.size() < op + 4)
+            continue;
+        latest[line.substr(op + 3)] = make_pair(strtoul(line.c_str(), NULL, 10), line[op + 1] == '-');
+    }
+    in.close();
+
+    string kept;
+    unsigned long entries = 0;
+    for(auto& entry : latest){
+        if(entry.second.second){
+            journal.floor = max(journal.floor, entry.second.first);
+        }else{
+            kept += to_string(entry.second.first) + " + " + entry.first + "\n";
+            entries++;
+        }
+    }
+
+    string tmpPath = journalPath(user) + ".tmp";
+    ofstream out(tmpPath, ios::trunc);
+    out << "# epoch " << journal.epoch << "\n# floor " << journal.floor << "\n# nextid " << journal.nextId << "\n" << kept;
+    out.close();
+    struct stat info;
+    if(rename(tmpPath.c_str(), journalPath(user).c_str()) == 0 && stat(journalPath(user).c_str(), &info) == 0){
+        journal.entries = entries;
+        journal.inode = info.st_ino;
+        journal.length = info.st_size;
+    }
+    //a mailbox with more messages than JOURNAL_COMPACT keeps that many
+    //entries, compacting again before it doubled would happen on every SEND
+    journal.compactAt = max((unsigned long)JOURNAL_COMPACT, 2 * journal.entries);
+}
+
+void syncMailbox(vector<string> msg, int* socket, string authenticatedUser){
+    //"<epoch>-<modseq>"; 0 or anything else asks for everything
+    unsigned long epoch = 0, since = 0;
+    if(msg.size() > 1 && sscanf(msg[1].c_str(), "%lu-%lu", &epoch, &since) != 2)
+        epoch = since = 0;
+
+    //read the journal under the locks so no half written line is seen
+    pthread_mutex_lock(&syncMutex);
+    int fd = lockJournal(authenticatedUser, loadJournal(authenticatedUser));
+    MailboxJournal journal = loadJournal(authenticatedUser);
+    map<string, bool> changes;      //filename -> removed
+    bool full = since == 0 || epoch != journal.epoch || since < journal.floor || since > journal.modseq;
+    if(!full){
+        ifstream file(journalPath(authenticatedUser));
+        string line;
+        while(getline(file, line)){
+            size_t op = line.find(' ');
+            if(line[0] == '#' || op == string::npos || line.size() < op + 4)
+                continue;
+            if(strtoul(line.c_str(), NULL, 10) > since)
+                changes[line.substr(op + 3)] = line[op + 1] == '-';
+        }
+    }
+    if(fd != -1)
+        close(fd);
+    pthread_mutex_unlock(&syncMutex);
+
+    //messages only, no temporary or quarantined files
+    if(full){
+        for(unsigned long id : listMessageIds(authenticatedUser))
+            changes[to_string(id) + ".txt"] = false;
+    }
+
+    string token = to_string(journal.epoch) + "-" + to_string(journal.modseq);
+    string response = to_string(changes.size()) + " " + token + (full ? " FULL" : "") + "\n";
+    for(auto& change : changes){
+        if(change.second)
+            response += "- " + change.first + "\n";
+        else
+            response += "+ " + change.first + " " + messageSubject(authenticatedUser, change.first) + "\n";
+    }
+    sendAll(*socket, response);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MESSAGE CACHE
+// LRU cache of message files keyed by "<user>/<filename>", split into shards
+// with their own lock so parallel READs rarely contend. Each shard gets an
+// equal part of the memory budget (--cache-mb, 0 disables the cache).
+// A miss returns the shard's generation; a file read from disk is only
+// inserted if no invalidation happened in the shard since, so a DEL that
+// runs during a READ cannot bring the deleted message back.
+
+void initMessageCache(){
+    for(int i = 0; i < CACHE_SHARDS; i++){
+        pthread_mutex_init(&messageCache[i].mutex, NULL);
+        messageCache[i].bytes = 0;
+        messageCache[i].generation = 0;
+    }
+}
+
+CacheShard& cacheShard(const string& key){
+    return messageCache[hash<string>()(key) % CACHE_SHARDS];
+}
+
+bool cacheLookup(string user, string filename, string& content, unsigned long* generation){
+    if(cacheBudget == 0){
+        return false;
+    }
+    string key = user + "/" + filename;
+    CacheShard& shard = cacheShard(key);
+
+    pthread_mutex_lock(&shard.mutex);
+    auto it = shard.index.find(key);
+    bool found = it != shard.index.end();
+    if(found){
+        //move to the front = most recently used
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        content = it->second->second;
+    }
+    if(generation != nullptr)
+        *generation = shard.generation;
+    pthread_mutex_unlock(&shard.mutex);
+
+    if(found)
+        cacheHits++;
+    else
+        cacheMisses++;
+    return found;
+}
+
+void cacheInsert(string user, string filename, const string& content, unsigned long generation){
+    size_t shardBudget = cacheBudget / CACHE_SHARDS;
+    string key = user + "/" + filename;
+    size_t size = key.size() + content.size();
+    if(size > shardBudget){
+        return;
+    }
+    CacheShard& shard = cacheShard(key);
+
+    pthread_mutex_lock(&shard.mutex);
+    //read before a DEL or SEND that invalidated meanwhile, maybe stale
+    if(shard.generation != generation){
+        pthread_mutex_unlock(&shard.mutex);
+        return;
+    }
+    auto it = shard.index.find(key);
+    if(it != shard.index.end()){
+        shard.bytes -= it->first.size() + it->second->second.size();
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    while(shard.bytes + size > shardBudget){
+        auto& oldest = shard.lru.back();
+        shard.bytes -= oldest.first.size() + oldest.second.size();
+        shard.index.erase(oldest.first);
+        shard.lru.pop_back();
+        cacheEvictions++;
+    }
+    shard.lru.emplace_front(key, content);
+    shard.index[key] = shard.lru.begin();
+    shard.bytes += size;
+    pthread_mutex_unlock(&shard.mutex);
+}
+
+void cacheInvalidate(string user, string filename){
+    if(cacheBudget == 0){
+        return;
+    }
+    string key = user + "/" + filename;
+    CacheShard& shard = cacheShard(key);
+
+    pthread_mutex_lock(&shard.mutex);
+    shard.generation++;
+    auto it = shard.index.find(key);
+    if(it != shard.index.end()){
+        shard.bytes -= it->first.size() + it->second->second.size();
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    pthread_mutex_unlock(&shard.mutex);
+}
+
+void printCacheStats(){
+    printf("Message cache: %lu hits, %lu misses, %lu evictions\n",
+           cacheHits.load(), cacheMisses.load(), cacheEvictions.load());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// REPLICATION
+// The primary numbers every SEND and DEL and keeps the last
+// --replication-log changes in memory. A follower connects to
+// --replication-port, says which epoch and sequence it has applied and gets
+// the missing changes; if they are no longer in the log it gets a snapshot
+// of the whole spool first. The port listens on loopback unless
+// --replication-bind names another address, and a follower must present the
+// shared --replication-secret, otherwise the connection is closed:
+//   REPLICATE <epoch> <seq> <secret>\n
+// The secret travels in clear text, keep the port on a trusted network.
+// Records on the wire:
+//   PUT <seq> <timestamp> <size>\n<user>\n<filename>\n<size bytes content>
+//   DEL <seq> <timestamp>\n<user>\n<filename>\n
+//   HEAD <seq> <timestamp>\n                 (heartbeat while idle)
+//   SNAPSHOT <epoch> <seq>\n ... PUT 0 ... SNAPSHOT-END\n
+// The follower answers with ACK <seq>\n after applying a batch.
+
+long long nowMillis(){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+//send the whole buffer, unlike sendMessage this is binary safe
+int sendAll(int socket, const string& data){
+    PhaseTimer timer(currentTiming.reply);
+    size_t sent = 0;
+    while(sent < data.size()){
+        ssize_t n = send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += n;
+    }
+    replyBytes += sent;
+    PROBE(reply_flush, socket, sent);
+    return 0;
+}
+
+//read one line (without \n); pending keeps bytes received after it
+int recvLine(int socket, string& pending, string& line){
+    size_t end;
+    while((end = pending.find('\n')) == string::npos){
+        char buffer[BUF];
+        ssize_t n = recv(socket, buffer, sizeof(buffer), 0);
+        if(n <= 0){
+            if(n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        pending.append(buffer, n);
+    }
+    line = pending.substr(0, end);
+    pending.erase(0, end + 1);
+    return 0;
+}
+
+int recvExact(int socket, string& pending, size_t size, string& data){
+    while(pending.size() < size){
+        char buffer[BUF];
+        ssize_t n = recv(socket, buffer, sizeof(buffer), 0);
+        if(n <= 0){
+            if(n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        pending.append(buffer, n);
+    }
+    data = pending.substr(0, size);
+    pending.erase(0, size);
+    return 0;
+}
+
+string formatChange(const ChangeRecord& record){
+    if(record.remove){
+        return "DEL " + to_string(record.seq) + " " + to_string(record.timestamp) + "\n" +
+               record.user + "\n" + record.filename + "\n";
     }
+    return "PUT " + to_string(record.seq) + " " + to_string(record.timestamp) + " " +
+           to_string(record.content.size()) + "\n" + record.user + "\n" + record.filename + "\n" +
+           record.content;
+}
 
+//append a change to the log, caller holds replicationMutex
+void logChange(bool remove, string user, string filename, const string& content){
+    ChangeRecord record;
+    record.seq = ++replicationSeq;
+    record.timestamp = nowMillis();
+    record.remove = remove;
+    record.user = user;
+    record.filename = filename;
+    record.content = content;
+    changeLog.push_back(record);
+    while(changeLog.size() > replicationLogSize){
+        changeLog.pop_front();
+    }
+    pthread_cond_broadcast(&replicationChanged);
+}
 
-    ////////////////////////////////////////////////////////////////////////////
-    // INIT ADDRESS
-    // Attention: network byte order => big endian
+int openReplicationSocket(){
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int reuseValue = 1;
+    struct sockaddr_in address;
     memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+    address.sin_addr.s_addr = replicationBind;
+    address.sin_port = htons(replicationPort);
 
-    ////////////////////////////////////////////////////////////////////////////
-    // ASSIGN AN ADDRESS WITH PORT TO SOCKET
-    if (bind(create_socket, (struct sockaddr*)&address, sizeof(address)) == -1)
+    if (sock == -1 ||
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuseValue, sizeof(reuseValue)) == -1 ||
+        bind(sock, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(sock, 5) == -1)
     {
-        perror("bind error");
-        return EXIT_FAILURE;
+        perror("replication socket");
+        if (sock != -1)
+            close(sock);
+        return -1;
     }
+    replicationEpoch = nowMillis();
 
-    ////////////////////////////////////////////////////////////////////////////
-    // ALLOW CONNECTION ESTABLISHING
-    // Socket, Backlog (= count of waiting connections allowed)
-    if (listen(create_socket, 5) == -1)
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, s_replicationListener, (void*)(intptr_t)sock) != 0)
     {
-        perror("listen error");
-        return EXIT_FAILURE;
+        perror("pthread_create");
+        close(sock);
+        return -1;
     }
+    printf("Accepting followers on port %d\n", replicationPort);
+    return 0;
+}
+
+void* s_replicationListener(void* arg){
+    int sock = (int)(intptr_t)arg;
+    pthread_detach(pthread_self());
 
-    //new thread
-    pthread_t thread;
     while (!abortRequested)
     {
-        /////////////////////////////////////////////////////////////////////////
-        // ignore errors here... because only information message
-        // https://linux.die.net/man/3/printf
-        printf("Waiting for connections...\n");
-
-        /////////////////////////////////////////////////////////////////////////
-        // ACCEPTS CONNECTION SETUP
-        // blocking, might have an accept-error on ctrl+c
-        addrlen = sizeof(struct sockaddr_in);
-        if ((new_socket = accept(create_socket,
-            (struct sockaddr*)&cliaddress,
-            &addrlen)) == -1)
+        struct sockaddr_in address;
+        socklen_t len = sizeof(address);
+        int fd = accept(sock, (struct sockaddr*)&address, &len);
+        if (fd == -1)
         {
-            if (abortRequested)
-            {
-                perror("accept error after aborted");
-            }
-            else
-            {
-                perror("accept error");
-            }
+            if (errno == EINTR)
+                continue;
+            perror("accept follower");
             break;
         }
-        //create thread
-        pthread_create(&thread, NULL, s_threading, (void*)&new_socket);
-    }
 
-    // frees the descriptor
-    if (create_socket != -1)
-    {
-        if (shutdown(create_socket, SHUT_RDWR) == -1)
-        {
-            perror("shutdown create_socket");
-        }
-        if (close(create_socket) == -1)
+        Follower* follower = new Follower();
+        follower->socket = fd;
+        char text[INET_ADDRSTRLEN];
+        follower->address = inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text)) ? text : "?";
+        follower->ackedSeq = 0;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, s_replicationFeed, follower) != 0)
         {
-            perror("close create_socket");
+            perror("pthread_create");
+            close(fd);
+            delete follower;
         }
-        create_socket = -1;
     }
-
-    return EXIT_SUCCESS;
+    close(sock);
+    return nullptr;
 }
 
-void * s_threading(void* arg){      //create thread for each client
-    cout << "A Client connected to the server!" << endl;
-    int clientfd = *((int*)arg);
+//compare without stopping at the first difference
+bool sameSecret(const string& given, const string& expected){
+    unsigned char difference = given.size() != expected.size();
+    for(size_t i = 0; i < given.size(); i++)
+        difference |= given[i] ^ expected[i % expected.size()];
+    return difference == 0;
+}
 
+//stream changes to one follower until it disconnects
+void* s_replicationFeed(void* arg){
+    Follower* follower = (Follower*)arg;
+    int fd = follower->socket;
     pthread_detach(pthread_self());
 
-    //client communication
-    clientCommunication(&clientfd);
-    close(clientfd);
-    return nullptr;
-}
-
-void sendMessage(int* socket, const char* msg){     //send message to client
-    if (send(*socket, msg, strlen(msg), 0) == -1)
+    //REPLICATE <epoch> <seq> <secret>
+    string pending, line, command, secret;
+    long long epoch = 0;
+    unsigned long sentSeq = 0;
+    stringstream handshake;
+    if (recvLine(fd, pending, line) != -1)
+        handshake.str(line);
+    handshake >> command >> epoch >> sentSeq;
+    getline(handshake >> ws, secret);
+    if (command != "REPLICATE" || !sameSecret(secret, replicationSecret))
     {
-        perror("Message send failed!");
+        printf("Follower %s rejected\n", follower->address.c_str());
+        close(fd);
+        delete follower;
+        return nullptr;
     }
-}
-
-void* clientCommunication(void* data)
-{
-    char buffer[BUF];
-    int size;
-    int* current_socket = (int*)data;
-    string authenticatedUser;
-    string clientIP;
-    int loginAttempts = 0;
-
-    ////////////////////////////////////////////////////////////////////////////
-    // SEND welcome message
+    printf("Follower %s connected at sequence %lu\n", follower->address.c_str(), sentSeq);
 
-    struct sockaddr_in clientAddress;
-    socklen_t len = sizeof(clientAddress);
+    pthread_mutex_lock(&replicationMutex);
+    followers.push_back(follower);
+    pthread_mutex_unlock(&replicationMutex);
 
-    if(getpeername(*current_socket, (struct sockaddr*)&clientAddress, &len) == 0){
-        printf("IP address is: %s\n", inet_ntoa(clientAddress.sin_addr));
-        clientIP=inet_ntoa(clientAddress.sin_addr);
-    }
-    strcpy(buffer, "Welcome to TWMailer!\r\nPlease enter one of the following commands:\r\n--> LOGIN \r\n--> SEND \r\n--> LIST \r\n--> READ (Type in the Subject instead of the Message-Number) \r\n--> DEL (Subject instead of Message-Number) \r\n--> QUIT \r\n");
-    if (send(*current_socket, buffer, strlen(buffer), 0) == -1)
+    bool needSnapshot = epoch != replicationEpoch;
+    bool connected = true;
+    while (connected && !abortRequested)
     {
-        perror("send failed");
-        return NULL;
-    }
+        if (needSnapshot)
+        {
+            if (sendSnapshot(fd, &sentSeq) == -1)
+                break;
+            needSnapshot = false;
+        }
 
-    do
-    {
-        /////////////////////////////////////////////////////////////////////////
-        // RECEIVE
-        size = recv(*current_socket, buffer, BUF - 1, 0);
-        if (size == -1)
+        //collect everything after sentSeq, or send a heartbeat after a second
+        string batch;
+        pthread_mutex_lock(&replicationMutex);
+        if (replicationSeq == sentSeq)
         {
-            if (abortRequested)
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&replicationChanged, &replicationMutex, &deadline);
+        }
+        if (replicationSeq > sentSeq)
+        {
+            if (changeLog.empty() || changeLog.front().seq > sentSeq + 1)
             {
-                perror("recv error after aborted");
+                needSnapshot = true;    //fell behind the retained log
             }
             else
             {
-                perror("recv error");
+                for (size_t i = sentSeq + 1 - changeLog.front().seq; i < changeLog.size(); i++)
+                {
+                    batch += formatChange(changeLog[i]);
+                }
+                sentSeq = replicationSeq;
             }
-            break;
         }
-
-        if (size == 0)
+        else
         {
-            printf("Client closed remote socket\n"); // ignore error
-            break;
+            batch = "HEAD " + to_string(replicationSeq) + " " + to_string(nowMillis()) + "\n";
         }
+        pthread_mutex_unlock(&replicationMutex);
 
-        // remove ugly debug message, because of the sent newline of client
-        if (buffer[size - 2] == '\r' && buffer[size - 1] == '\n')
+        if (!batch.empty() && sendAll(fd, batch) == -1)
+            break;
+
+        //pick up acknowledgements without blocking the stream
+        char buffer[BUF];
+        ssize_t n;
+        while ((n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
         {
-            size -= 2;
+            pending.append(buffer, n);
         }
-        else if (buffer[size - 1] == '\n')
+        if (n == 0)
+            connected = false;
+        size_t end;
+        while ((end = pending.find('\n')) != string::npos)
         {
-            --size;
+            if (pending.compare(0, 4, "ACK ") == 0)
+            {
+                pthread_mutex_lock(&replicationMutex);
+                follower->ackedSeq = strtoul(pending.c_str() + 4, NULL, 10);
+                pthread_mutex_unlock(&replicationMutex);
+            }
+            pending.erase(0, end + 1);
         }
+    }
 
-        buffer[size] = '\0';
-        //printf("Message received: %s\n", buffer); // ignore error
+    printf("Follower %s disconnected\n", follower->address.c_str());
+    pthread_mutex_lock(&replicationMutex);
+    for (size_t i = 0; i < followers.size(); i++)
+    {
+        if (followers[i] == follower)
+            followers.erase(followers.begin() + i);
+    }
+    pthread_mutex_unlock(&replicationMutex);
+    close(fd);
+    delete follower;
+    return nullptr;
+}
 
-        /*
-        if (send(*current_socket, "OK", 3, 0) == -1)
-        {
-            perror("send answer failed");
-            return NULL;
-        }
-        */
-        vector<string> msg;
-        string line = "";
-        stringstream ss;
-        ss << buffer << "\n";
+//send every message of the spool; changes after *startSeq follow as usual
+//and are idempotent, so the snapshot does not need to block writers
+int sendSnapshot(int socket, unsigned long* startSeq){
+    pthread_mutex_lock(&replicationMutex);
+    *startSeq = replicationSeq;
+    pthread_mutex_unlock(&replicationMutex);
+
+    if (sendAll(socket, "SNAPSHOT " + to_string(replicationEpoch) + " " + to_string(*startSeq) + "\n") == -1)
+        return -1;
 
-        while (getline(ss, line))       //save msg in vector
+    for (string user : listFiles(dirname.c_str()))
+    {
+        if (user[0] == '.')
+            continue;
+        for (string filename : listFiles(mailboxPath(user).c_str()))
         {
-            msg.push_back(line);
+            ifstream file(mailboxPath(user) + filename);
+            if (!file.is_open())
+                continue;
+            stringstream content;
+            content << file.rdbuf();
+
+            ChangeRecord record;
+            record.seq = 0;
+            record.timestamp = nowMillis();
+            record.remove = false;
+            record.user = user;
+            record.filename = filename;
+            record.content = content.str();
+            if (sendAll(socket, formatChange(record)) == -1)
+                return -1;
         }
+    }
+    return sendAll(socket, "SNAPSHOT-END\n");
+}
 
-        if(authenticatedUser.empty()){
-            if(msg[0] == "QUIT"){
-                printf("Client closed connection\n");
-                break;
-            }
+//follower: stay connected to the primary and apply its changes
+void* s_follow(void*){
+    pthread_detach(pthread_self());
 
-            if(msg[0] != "LOGIN"){
-                printf("Unauthorized! Login first.");
-                sendMessage(current_socket, "ERR");
-            }else{
-                if(checkBlacklisted(clientIP)){
-                    sendMessage(current_socket, "Zu viele Anmeldungsversuche, in einer Minute erneut versuchen");
-                }
-                else if(authenticateUser(msg) == EXIT_FAILURE){
-                    loginAttempts++;
-                    if(loginAttempts>=3){
-                        blackListUser(clientIP);
-                    }
-                    sendMessage(current_socket, "ERR");
-                }
-                else{
-                    loginAttempts=0;
-                    authenticatedUser = msg[1];
-                    sendMessage(current_socket, "OK");
-                }
-            }   
-        }else{
-            if(msg[0] =="SEND"){        //execute functions for each command
-                if(saveMessage(msg) == -1)
-                    sendMessage(current_socket, "ERR");
-                else
-                    sendMessage(current_socket, "OK");
-            }else if(msg[0] =="LIST"){
-                listMessages(current_socket, authenticatedUser);
-            }else if(msg[0] =="READ"){
-                readMessage(msg, current_socket, authenticatedUser);
-            }else if(msg[0] =="DEL"){
-                delMessage(msg, current_socket, authenticatedUser);
-            }else if(msg[0] =="QUIT"){
-                printf("Client closed connection\n");
-            }else{
-                sendMessage(current_socket, "Wrong Command, try again!");
-            }
-        }
-        
-    } while (strcmp(buffer, "quit") != 0 && !abortRequested);
+    string host = followAddress.substr(0, followAddress.rfind(':'));
+    string port = followAddress.substr(followAddress.rfind(':') + 1);
+    string statePath = dirname + "/.replication";
 
-    // closes/frees the descriptor if not already
-    if (*current_socket != -1)
+    while (!abortRequested)
     {
-        if (shutdown(*current_socket, SHUT_RDWR) == -1)
+        struct addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        int sock = -1;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) == 0)
         {
-            perror("shutdown new_socket");
+            sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (sock != -1 && connect(sock, result->ai_addr, result->ai_addrlen) == -1)
+            {
+                close(sock);
+                sock = -1;
+            }
+            freeaddrinfo(result);
         }
-        if (close(*current_socket) == -1)
+
+        if (sock == -1)
         {
-            perror("close new_socket");
+            perror("connect to primary");
         }
-        *current_socket = -1;
-    }
-
-    return NULL;
-}
-
-//Save sent message in given mail spool directory
-int saveMessage(vector<string> msg){
-    char cdir[256];
-    getcwd(cdir, 256);
-    char tmp_dir[256];
-    getcwd(tmp_dir, 256);
-    //strcat(tmp_dir, cdir);
-    //change directory to given path
-    chdir(dirname.c_str());
-
-    //create new directory
-    mkdir(msg[1].c_str(), 0777);
-
-    //get current working directory
-    getcwd(cdir, 256);
-    
-    //create path
-    strcat(cdir, "/");
-    strcat(cdir, msg[1].c_str());
-    strcat(cdir, "/");
-
-    chdir(cdir);
-
-    //save message in new file
-    ofstream newFile(msg[2] + ".txt");
-    newFile << msg[1] << "\n" << msg[2] << "\n" << msg[3];
-    newFile.close(); 
-    chdir(tmp_dir);
-    return 1;
-}
-
-vector<string> listFiles(char* directory){
-    DIR *dir;
-    struct dirent *file;
-    vector<string> files;
-    
-    //get all filenames from given directory and copy them into vector
-    if ((dir = opendir(directory)) != NULL) {
-        while ((file = readdir(dir)) != NULL) {
-            if(strcmp(file->d_name, ".") != 0 && strcmp(file->d_name, "..") != 0)
-                files.push_back(file->d_name);
+        else
+        {
+            printf("Following primary %s\n", followAddress.c_str());
+            followPrimary(sock, statePath);
+            close(sock);
+            printf("Lost connection to primary\n");
         }
-        closedir(dir);
-    }else{
-        cerr << "Error opening directory" << endl;
+        sleep(1);
     }
-    return files;
+    return nullptr;
 }
 
-void listMessages(int* socket, string authenticatedUser){
-    char dir[256] = "";
-    strcat(dir, dirname.c_str());
-    strcat(dir, "/");
-    strcat(dir, authenticatedUser.c_str());
-    strcat(dir, "/");
-
-    cout << dir << endl; 
+//apply the primary's stream; returns when the connection ends
+int followPrimary(int socket, string& statePath){
+    //resume from what was applied before a restart
+    long long epoch = 0;
+    unsigned long seq = 0;
+    ifstream state(statePath);
+    state >> epoch >> seq;
+    state.close();
+    appliedSeq = seq;
+
+    if (sendAll(socket, "REPLICATE " + to_string(epoch) + " " + to_string(seq) + " " + replicationSecret + "\n") == -1)
+        return -1;
 
-    vector<string> files = listFiles(dir);      //get filenames
- 
-    string size = to_string(files.size()) += "\n";
-    //send filenames to client
-    sendMessage(socket, size.c_str());        
-    for(string file : files){
-        file += "\n";
-        sendMessage(socket, file.c_str());
-    }
-}
+    string pending, line, user, filename, content;
+    bool inSnapshot = false;
+    set<string> snapshotFiles;
+    while (recvLine(socket, pending, line) == 0)
+    {
+        string type;
+        unsigned long recordSeq = 0;
+        long long timestamp = 0;
+        size_t size = 0;
+        stringstream(line) >> type >> recordSeq >> timestamp >> size;
 
-void readMessage(vector<string> msg, int* socket, string authenticatedUser){
-    char dir[256] = "";
-    char response[500] = "";
-    DIR *directory;
-    struct dirent *file;
-    string fileText;
-    strcat(dir, dirname.c_str());
-    strcat(dir, "/");
-
-    char tempDir[256]= "";
-    getcwd(tempDir, 256);       //get current working directory, so after reading message, we can go back to base wd
-
-    strcat(dir, authenticatedUser.c_str());
-    strcat(dir, "/");
-
-    msg[1] += ".txt";
-    chdir(dir);
-    getcwd(dir, 256);
-
-    //open directory and read file content
-    if ((directory = opendir(dir)) != NULL) { 
-        while ((file = readdir(directory)) != NULL) {
-            if(strcmp(file->d_name, msg[1].c_str()) == 0){      //compare filenames
-                getcwd(dir, 256);
-                ifstream newfile;
-                newfile.open(file->d_name, ios::in);        //open file 
-
-                if(newfile.is_open()){
-                    strcat(response, "OK\n");
-                    while(getline(newfile, fileText)){      //get content from file
-                        fileText += "\n";
-                        strcat(response, fileText.c_str());
-                    }
-                    sendMessage(socket, response);
-                    newfile.close(); //close the file object
-                }else{
-                    cerr << "Error opening file" << endl;
-                    sendMessage(socket, "ERR");
+        if (type == "SNAPSHOT")
+        {
+            //SNAPSHOT <epoch> <seq>
+            inSnapshot = true;
+            epoch = (long long)recordSeq;
+            seq = (unsigned long)timestamp;
+            snapshotFiles.clear();
+            printf("Receiving snapshot of primary at sequence %lu\n", seq);
+            continue;
+        }
+        if (type == "SNAPSHOT-END")
+        {
+            //everything the snapshot did not contain is gone on the primary
+            for (string mailbox : listFiles(dirname.c_str()))
+            {
+                if (mailbox[0] == '.')
+                    continue;
+                for (string file : listFiles(mailboxPath(mailbox).c_str()))
+                {
+                    if (snapshotFiles.count(mailbox + "/" + file) == 0)
+                        applyChange(true, mailbox, file, "");
                 }
-                break;
             }
+            inSnapshot = false;
+            snapshotFiles.clear();
+        }
+        else if (type == "HEAD")
+        {
+            primaryHeadSeq = recordSeq;
+            if (appliedSeq == recordSeq)
+                applyDelay = 0;
+            continue;
+        }
+        else if (type == "PUT" || type == "DEL")
+        {
+            if (recvLine(socket, pending, user) == -1 || recvLine(socket, pending, filename) == -1)
+                return -1;
+            content.clear();
+            if (type == "PUT" && recvExact(socket, pending, size, content) == -1)
+                return -1;
+
+            applyChange(type == "DEL", user, filename, content);
+            if (inSnapshot)
+            {
+                snapshotFiles.insert(user + "/" + filename);
+                continue;
+            }
+            seq = recordSeq;
+            if (primaryHeadSeq < seq)
+                primaryHeadSeq = seq;
+            applyDelay = nowMillis() - timestamp;
+        }
+        else
+        {
+            cerr << "Unknown replication record: " << line << endl;
+            return -1;
         }
-        
-        closedir(directory);
-        
-        chdir(tempDir);             //change back to working directory
-        getcwd(tempDir, 256);
 
-    }else{
-        cerr << "Error opening directory" << endl;
-        sendMessage(socket, "ERR");
+        //acknowledge and persist once the received batch is applied
+        if (pending.empty() && !inSnapshot)
+        {
+            appliedSeq = seq;
+            ofstream out(statePath, ios::trunc);
+            out << epoch << " " << seq << "\n";
+            out.close();
+            if (sendAll(socket, "ACK " + to_string(seq) + "\n") == -1)
+                return -1;
+        }
     }
+    return -1;
 }
 
-void delMessage(vector<string> msg, int* socket, string authenticatedUser){
-    char dir[256] = "";
-
-    char tempDir[256]= "";
-    getcwd(tempDir, 256);
+//write or remove one message file on the follower
+int applyChange(bool remove, string user, string filename, const string& content){
+    if (user.empty() || filename.empty() || user[0] == '.' || filename[0] == '.' ||
+        user.find('/') != string::npos || filename.find('/') != string::npos)
+    {
+        cerr << "Rejected replicated path " << user << "/" << filename << endl;
+        return -1;
+    }
 
-    //change to desired directory
-    strcat(dir, dirname.c_str());
-    strcat(dir, "/");
-    strcat(dir, authenticatedUser.c_str());
-    strcat(dir, "/");
-    chdir(dir);
+    int rc = 0;
+    if (remove)
+    {
+        if (::remove((mailboxPath(user) + filename).c_str()) == 0)
+        {
+            forgetSubject(user, filename);
+            recordChange(user, filename, true);
+        }
+        else if (errno != ENOENT)
+            rc = -1;
+    }
+    else
+    {
+        //write aside and rename, so READ never sees half a message
+        string tmpPath = dirname + "/.replica.tmp";
+        mkdir(mailboxPath(user).c_str(), 0777);
+        ofstream file(tmpPath, ios::trunc | ios::binary);
+        file << content;
+        file.close();
+        rc = file.fail() ? -1 : rename(tmpPath.c_str(), (mailboxPath(user) + filename).c_str());
+        if (rc == 0)
+        {
+            rememberSubject(user, filename, contentSubject(content));
+            recordChange(user, filename, false);
+            notifyWatchers(user, filename);
+        }
+    }
+    cacheInvalidate(user, filename);
+    return rc;
+}
 
-    msg[1] += ".txt";
-    
-    //remove file from dir
-    if(remove(msg[1].c_str()) == 0){
-        sendMessage(socket, "OK");
-    }else{
-        sendMessage(socket, "ERR");
+void printReplicationStats(){
+    if (!followAddress.empty())
+    {
+        unsigned long head = primaryHeadSeq.load();
+        unsigned long applied = appliedSeq.load();
+        printf("Replication: applied %lu of %lu, lag %lu changes, %lld ms\n",
+               applied, head, head > applied ? head - applied : 0, applyDelay.load());
+    }
+    if (replicationPort != 0)
+    {
+        pthread_mutex_lock(&replicationMutex);
+        printf("Replication: at sequence %lu, %zu followers\n", replicationSeq, followers.size());
+        for (Follower* follower : followers)
+        {
+            printf("  %s acknowledged %lu, lag %lu changes\n", follower->address.c_str(),
+                   follower->ackedSeq, replicationSeq - follower->ackedSeq);
+        }
+        pthread_mutex_unlock(&replicationMutex);
     }
-    chdir(tempDir);
 }
 
 void signalHandler(int sig)
@@ -533,6 +3697,10 @@ void signalHandler(int sig)
             create_socket = -1;
         }
     }
+    else if (sig == SIGUSR1)
+    {
+        timingDumpRequested = 1;
+    }
     else
     {
         exit(sig);
@@ -654,18 +3822,23 @@ int ldapAuthentication(const char ldapBindPassword[], const char ldapUser[]){
 void blackListUser(string clientIP){
     time_t currTime = time(nullptr);
     cout << currTime << " seconds since the Epoch\n";
-    blackList.insert(pair<string, time_t>(clientIP, currTime));
-    
+    //a returning offender starts a new minute, insert would keep the old one
+    pthread_rwlock_wrlock(&blackListLock);
+    blackList[clientIP] = currTime;
+    pthread_rwlock_unlock(&blackListLock);
 }
 
+//every session checks on LOGIN, so lookups only take the lock shared
 bool checkBlacklisted(string clientIP){
+    pthread_rwlock_rdlock(&blackListLock);
     auto it = blackList.find(clientIP);
-    if ( it == blackList.end() ) {  
+    bool listed = it != blackList.end();
+    time_t timeStampBlacklist = listed ? it->second : 0;
+    pthread_rwlock_unlock(&blackListLock);
+    if ( !listed ) {  
         return false;
     } 
 
-    time_t timeStampBlacklist=it->second;
-
     time_t currentTime = time(nullptr);
 
     if(currentTime-timeStampBlacklist<60){